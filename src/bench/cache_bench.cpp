@@ -0,0 +1,237 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+
+#include "cache.H"
+
+/* ===================================================================== */
+/*  cache-bench - tag lookup and fill throughput of the structure-of-     */
+/*  arrays Cache against the array-of-structs sets it replaced, on the   */
+/*  same pseudo-random line stream, of every replacement policy, and of  */
+/*  the compile-time geometry at 64 sets x 8 ways.                       */
+/* ===================================================================== */
+
+/* ===================================================================== */
+/*  @brief Legacy Set - the former Cache_Set, 40-byte lines scanned one  */
+/*         at a time. NOTE: reference only, keep in sync with history   */
+/* ===================================================================== */
+class Legacy_Line
+{
+public:
+    Legacy_Line(): lru(0), tag(ALL_ONES), addr(0), lock(false), status(LOCAL_STATUS::UNCACHED){}
+
+public:
+    uint64_t lru;
+    uint64_t tag;
+    uint64_t addr;
+    bool lock;
+    LOCAL_STATUS status;
+};
+
+class Legacy_Set
+{
+public:
+    Legacy_Set(int32_t associativity)
+    {
+        _lines = std::vector<Legacy_Line>(associativity, Legacy_Line());
+    }
+
+    inline Legacy_Line * find(uint64_t tag)
+    {
+        for (auto & _line : _lines)
+        {
+            if (_line.tag == tag) {
+                return &_line;
+            }
+        }
+        return nullptr;
+    }
+
+    inline LOCAL_STATUS fetch_single_line(uint64_t tag, uint64_t addr, bool &evicted, uint64_t &victim)
+    {
+        Legacy_Line *line = find(tag);
+        if (line != nullptr)
+        {
+            ++line->lru;
+            return line->status;
+        }
+
+        uint64_t _min = _lines[0].lru;
+        int32_t _evict = 0;
+        for (uint32_t i = 1; i < _lines.size(); ++i)
+        {
+            if (_lines[i].lru < _min)
+            {
+                _evict = i;
+                _min = _lines[i].lru;
+            }
+        }
+        if (_lines[_evict].status != LOCAL_STATUS::UNCACHED)
+        {
+            evicted = true;
+            victim = _lines[_evict].addr;
+        }
+        ++_lines[_evict].lru;
+        _lines[_evict].tag = tag;
+        _lines[_evict].addr = addr;
+        _lines[_evict].status = LOCAL_STATUS::CACHED;
+        return LOCAL_STATUS::UNCACHED;
+    }
+
+private:
+    std::vector<Legacy_Line>  _lines;
+};
+
+// line addresses drawn from 'footprint' lines, skewed so most accesses hit
+std::vector<uint64_t> make_stream(size_t length, uint64_t footprint, uint32_t line_size)
+{
+    std::vector<uint64_t> stream(length);
+    uint64_t x = 88172645463325252ull;
+    for (auto &addr : stream)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint64_t line = (x % 8 == 0) ? (x >> 8) % footprint : (x >> 8) % (footprint / 16);
+        addr = line * line_size;
+    }
+    return stream;
+}
+
+template <typename F>
+double rate(const char *name, size_t accesses, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    uint64_t checksum = f();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double mops = accesses / seconds / 1e6;
+    std::cout << std::setw(28) << std::left << name << std::setw(10) << std::right << std::fixed
+              << std::setprecision(1) << mops << " M/s  (checksum " << checksum << ")" << std::endl;
+    return mops;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_sets = argc > 1 ? atoi(argv[1]) : 64;
+    uint32_t ways = argc > 2 ? atoi(argv[2]) : 8;
+    uint32_t rounds = argc > 3 ? atoi(argv[3]) : 20;
+    const uint32_t line_size = 64;
+    const uint32_t offset_bits = __builtin_ctz(line_size);
+    const uint64_t tag_mask = ALL_ONES << (offset_bits + __builtin_ctz(num_sets));
+
+    std::vector<uint64_t> stream = make_stream(1 << 20, 4ull * num_sets * ways, line_size);
+    size_t accesses = stream.size() * rounds;
+#if defined(__AVX2__)
+    const char *isa = "AVX2";
+#elif defined(__SSE4_2__)
+    const char *isa = "SSE4.2";
+#else
+    const char *isa = "scalar";
+#endif
+    std::cout << num_sets << " sets x " << ways << " ways, " << accesses << " accesses, "
+              << isa << " scan" << std::endl;
+
+    std::vector<Legacy_Set> legacy(num_sets, Legacy_Set(ways));
+    Cache arena(ways, num_sets);
+
+    // fills first, they leave both layouts with the same contents
+    double legacy_fill = rate("fetch, array of structs", accesses, [&]() {
+        uint64_t evictions = 0;
+        for (uint32_t r = 0; r < rounds; ++r)
+        {
+            for (uint64_t addr : stream)
+            {
+                bool evicted = false;
+                uint64_t victim = 0;
+                legacy[(addr >> offset_bits) & (num_sets - 1)].fetch_single_line(addr & tag_mask, addr, evicted, victim);
+                evictions += evicted;
+            }
+        }
+        return evictions;
+    });
+    double arena_fill = rate("fetch, structure of arrays", accesses, [&]() {
+        uint64_t evictions = 0;
+        for (uint32_t r = 0; r < rounds; ++r)
+        {
+            for (uint64_t addr : stream)
+            {
+                bool evicted = false;
+                uint64_t victim = 0;
+                arena.fetch_single_line(ways, (addr >> offset_bits) & (num_sets - 1), addr & tag_mask, addr, true, evicted, victim);
+                evictions += evicted;
+            }
+        }
+        return evictions;
+    });
+
+    double legacy_find = rate("lookup, array of structs", accesses, [&]() {
+        uint64_t hits = 0;
+        for (uint32_t r = 0; r < rounds; ++r)
+        {
+            for (uint64_t addr : stream) {
+                hits += legacy[(addr >> offset_bits) & (num_sets - 1)].find(addr & tag_mask) != nullptr;
+            }
+        }
+        return hits;
+    });
+    double arena_find = rate("lookup, structure of arrays", accesses, [&]() {
+        uint64_t hits = 0;
+        for (uint32_t r = 0; r < rounds; ++r)
+        {
+            for (uint64_t addr : stream) {
+                hits += arena.find(ways, (addr >> offset_bits) & (num_sets - 1), addr & tag_mask) != NO_SLOT;
+            }
+        }
+        return hits;
+    });
+
+    std::cout << "speedup: fetch " << std::setprecision(2) << arena_fill / legacy_fill
+              << "x, lookup " << arena_find / legacy_find << "x" << std::endl;
+
+    // replacement policies, fills on a fresh arena each
+    const REPLACEMENT policies[] = {REPLACEMENT::LFU, REPLACEMENT::LRU, REPLACEMENT::PLRU,
+                                    REPLACEMENT::SRRIP, REPLACEMENT::BRRIP, REPLACEMENT::DRRIP};
+    for (REPLACEMENT policy : policies)
+    {
+        if (ways > replacement_max_ways(policy) || (policy == REPLACEMENT::PLRU && (ways & (ways - 1)))) {
+            continue;
+        }
+        Cache policy_arena(ways, num_sets);
+        policy_arena.set_policy(policy);
+        std::string name = std::string("fetch, ") + replacement_name(policy);
+        rate(name.c_str(), accesses, [&]() {
+            uint64_t evictions = 0;
+            for (uint32_t r = 0; r < rounds; ++r)
+            {
+                for (uint64_t addr : stream)
+                {
+                    bool evicted = false;
+                    uint64_t victim = 0;
+                    policy_arena.fetch_single_line(ways, (addr >> offset_bits) & (num_sets - 1), addr & tag_mask, addr, true, evicted, victim);
+                    evictions += evicted;
+                }
+            }
+            return evictions;
+        });
+    }
+
+    // decoding and scans as in the controllers make_controller() specializes
+    if (num_sets == 64 && ways == 8)
+    {
+        Fixed_Geometry<64, 8, 64, 4> geometry(4, 64, 64, 8);
+        double fixed_find = rate("lookup, fixed 64x8x64", accesses, [&]() {
+            uint64_t hits = 0;
+            for (uint32_t r = 0; r < rounds; ++r)
+            {
+                for (uint64_t addr : stream) {
+                    hits += arena.find(geometry.ways(), geometry.set_index(addr), geometry.tag(addr)) != NO_SLOT;
+                }
+            }
+            return hits;
+        });
+        std::cout << "speedup: fixed lookup " << fixed_find / legacy_find << "x" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,736 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.H"
+#include "config.H"
+#include "trace.H"
+
+/* ===================================================================== */
+/*  cohsim-replay - simulate a trace recorded with 'Simulator -record'   */
+/*  without Pin. Chunks are decoded in place from the mapped file.       */
+/* ===================================================================== */
+
+typedef struct
+{
+    uint64_t        seq;
+    uint64_t        mark;     // first mark of the chunk, 'seq' in version 1
+    uint32_t        tid;
+    uint32_t        flags;
+    const uint8_t   *begin;
+    const uint8_t   *end;
+    uint32_t        pid;
+} CHUNK_REF;
+
+uint32_t next_pid = 0;
+uint32_t num_processors;
+std::unordered_map<uint32_t, uint32_t> t_map;  // thread id -> processor id
+
+// NOTE: same assignment as thread_attach() in the pintool
+inline uint32_t get_next_pid()
+{
+    return next_pid == num_processors ? 0 : next_pid++;
+}
+
+int usage()
+{
+    std::cerr << "usage: cohsim-replay [-c cache.config] [-o cache.out] [-j threads] [-shards n] [-generic]" << std::endl
+              << "                     [-top_lines n] [-line_counters n] [-spin n]" << std::endl
+              << "                     [-quantum cycles [-timeline file.csv] | -mrc max_sets] <trace>" << std::endl;
+    return -1;
+}
+
+// decode a chunk once and take its first mark, false if it does not hold 'records' accesses
+bool check_chunk(CHUNK_REF &ref, uint32_t records, uint32_t version)
+{
+    Trace_Decoder decoder(ref.begin, ref.end);
+    Trace_Event event;
+    uint32_t accesses = 0;
+    if (version != TRACE_VERSION_UNMARKED)
+    {
+        if (!decoder.next(event) || event.flags != TRACE_MARK)
+        {
+            return false;
+        }
+        ref.mark = event.addr;
+    }
+    while (decoder.next(event))
+    {
+        accesses += !(event.flags & TRACE_MARK);
+    }
+    return !decoder.failed() && accesses == records;
+}
+
+// index the chunks of a mapped trace, return false if the file is malformed
+bool index_chunks(const uint8_t *data, size_t size, std::vector<CHUNK_REF> &chunks)
+{
+    Trace_Header header;
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        (header.version != TRACE_VERSION && header.version != TRACE_VERSION_UNMARKED))
+    {
+        return false;
+    }
+
+    const uint8_t *p = data + sizeof(header);
+    const uint8_t *end = data + size;
+    while (p + sizeof(Chunk_Header) <= end)
+    {
+        Chunk_Header chunk;
+        memcpy(&chunk, p, sizeof(chunk));  // NOTE: chunk headers are not aligned
+        p += sizeof(chunk);
+        if (chunk.bytes > static_cast<size_t>(end - p))
+        {
+            return false;
+        }
+
+        CHUNK_REF ref = {chunk.seq, chunk.seq, chunk.tid, chunk.flags, p, p + chunk.bytes, 0};
+        if (!check_chunk(ref, chunk.records, header.version))
+        {
+            return false;
+        }
+        chunks.push_back(ref);
+        p += chunk.bytes;
+    }
+    return p == end;
+}
+
+// assign processors in trace order, same as the pintool does at thread start
+void assign_pids(std::vector<CHUNK_REF> &chunks)
+{
+    for (auto &chunk : chunks)
+    {
+        auto it = t_map.find(chunk.tid);
+        if (it == t_map.end())
+        {
+            it = t_map.insert(std::make_pair(chunk.tid, get_next_pid())).first;
+        }
+        chunk.pid = it->second;
+
+        if (chunk.flags & TRACE_CHUNK_LAST)
+        {
+            t_map.erase(it);
+        }
+    }
+}
+
+/* ===================================================================== */
+/*  @brief Thread Stream - the chunks of one recorded thread, decoded    */
+/*         lazily. 'mark' orders its next access against other threads   */
+/* ===================================================================== */
+class Thread_Stream
+{
+public:
+    Thread_Stream(uint32_t pid, uint32_t order)
+        : pid(pid), order(order), mark(0), _decoder(nullptr, nullptr), _next_chunk(0) {}
+
+    // next access or mark of the thread, false at its end
+    inline bool next(Trace_Event &event)
+    {
+        if (!_decoder.next(event))
+        {
+            if (_next_chunk == chunks.size())
+            {
+                return false;
+            }
+            // NOTE: a chunk starts at its first mark, the only one in version 1
+            const CHUNK_REF *chunk = chunks[_next_chunk++];
+            _decoder = Trace_Decoder(chunk->begin, chunk->end);
+            event.addr = chunk->mark;
+            event.flags = TRACE_MARK;
+        }
+        if (event.flags & TRACE_MARK)
+        {
+            mark = event.addr;
+        }
+        return true;
+    }
+
+public:
+    std::vector<const CHUNK_REF *> chunks;
+    uint32_t pid;
+    uint32_t order;    // thread start order, breaks ties between equal marks
+    uint64_t mark;
+
+private:
+    Trace_Decoder _decoder;
+    size_t _next_chunk;
+};
+
+/* ===================================================================== */
+/*  @brief Merged Stream - merges the accesses of several threads in     */
+/*         (mark, start order). A thread runs until its next mark, only  */
+/*         then another thread with an earlier mark may take over        */
+/* ===================================================================== */
+class Merged_Stream
+{
+public:
+    Merged_Stream() : _current(nullptr) {}
+
+    void add(Thread_Stream *thread)
+    {
+        thread->mark = thread->chunks.front()->mark;
+        _heap.push_back(thread);
+        std::push_heap(_heap.begin(), _heap.end(), later);
+    }
+
+    // next access in merged order and the processor of its thread, false at the end
+    inline bool next(Trace_Event &event, uint32_t &pid)
+    {
+        for (;;)
+        {
+            if (_current == nullptr)
+            {
+                if (_heap.empty())
+                {
+                    return false;
+                }
+                std::pop_heap(_heap.begin(), _heap.end(), later);
+                _current = _heap.back();
+                _heap.pop_back();
+            }
+
+            if (!_current->next(event))
+            {
+                _current = nullptr;
+            }
+            else if (!(event.flags & TRACE_MARK))
+            {
+                pid = _current->pid;
+                return true;
+            }
+            else if (!_heap.empty() && later(_current, _heap.front()))
+            {
+                _heap.push_back(_current);
+                std::push_heap(_heap.begin(), _heap.end(), later);
+                _current = nullptr;
+            }
+        }
+    }
+
+private:
+    static bool later(const Thread_Stream *a, const Thread_Stream *b)
+    {
+        return a->mark != b->mark ? a->mark > b->mark : a->order > b->order;
+    }
+
+private:
+    std::vector<Thread_Stream *> _heap;  // NOTE: min-heap on (mark, order)
+    Thread_Stream *_current;
+};
+
+// split the chunks into one stream per thread lifetime, in thread start order
+void split_threads(const std::vector<CHUNK_REF> &chunks, std::deque<Thread_Stream> &threads)
+{
+    std::unordered_map<uint32_t, Thread_Stream *> live;  // thread id -> its current stream
+    for (const auto &chunk : chunks)
+    {
+        auto it = live.find(chunk.tid);
+        if (it == live.end())
+        {
+            threads.push_back(Thread_Stream(chunk.pid, threads.size()));
+            it = live.insert(std::make_pair(chunk.tid, &threads.back())).first;
+        }
+        it->second->chunks.push_back(&chunk);
+
+        if (chunk.flags & TRACE_CHUNK_LAST)
+        {
+            live.erase(it);
+        }
+    }
+}
+
+// simulate the merged accesses on one lane, return the number of accesses
+uint64_t replay_stream(Controller &controller, Merged_Stream &stream, uint32_t lane)
+{
+    uint64_t accesses = 0;
+    Trace_Event event;
+    uint32_t pid;
+    while (stream.next(event, pid))
+    {
+        if (event.flags & TRACE_PRIVATE) {
+            controller.private_single_line(event.addr, pid, lane);
+        } else if (event.flags & TRACE_WRITE) {
+            controller.store_single_line(event.addr, pid, lane, event.pc);
+        } else {
+            controller.load_single_line(event.addr, pid, lane, event.pc);
+        }
+        ++accesses;
+    }
+    return accesses;
+}
+
+/* ===================================================================== */
+/*  @brief Barrier - blocks until all workers arrived                    */
+/* ===================================================================== */
+class Barrier
+{
+public:
+    Barrier(uint32_t count) : _count(count), _waiting(0), _generation(0) {}
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        uint64_t generation = _generation;
+        if (++_waiting == _count)
+        {
+            _waiting = 0;
+            ++_generation;
+            _cv.notify_all();
+            return;
+        }
+        _cv.wait(lock, [&] { return generation != _generation; });
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    uint32_t _count;
+    uint32_t _waiting;
+    uint64_t _generation;
+};
+
+/* ===================================================================== */
+/*  @brief Core Stream - accesses of one simulated core and its clock    */
+/* ===================================================================== */
+class Core_Stream
+{
+public:
+    Core_Stream()
+        : pending(false), blocked(false), clock(0), accesses(0), local(0) {}
+
+    // peek the next access, false at the end of the stream
+    inline bool next_event()
+    {
+        uint32_t pid;
+        if (!pending) {
+            pending = stream.next(event, pid);
+        }
+        return pending;
+    }
+
+    inline void retire(uint64_t cost)
+    {
+        clock += cost;
+        pending = false;
+        ++accesses;
+    }
+
+public:
+    Merged_Stream stream;  // threads of this core
+    Trace_Event event;
+    bool pending;      // event is peeked but not simulated
+    bool blocked;      // event waits for the quantum boundary
+    uint64_t clock;    // simulated cycles
+    uint64_t accesses;
+    uint64_t local;    // accesses simulated inside a quantum
+    char pad[64];      // keep cores of different workers off each other's cache lines
+};
+
+/* ===================================================================== */
+/*  @brief Quantum Scheduler - cores advance their own clocks in         */
+/*         parallel for one quantum, serving only accesses their private */
+/*         cache can serve alone. Any access that needs the directory    */
+/*         blocks its core until the boundary, where the blocked         */
+/*         accesses are simulated in (clock, pid) order. The result is   */
+/*         independent of the number of workers.                         */
+/* ===================================================================== */
+class Quantum_Scheduler
+{
+public:
+    Quantum_Scheduler(Controller               &controller,
+                      std::vector<Core_Stream> &cores,
+                      uint64_t                 quantum,
+                      uint32_t                 num_workers,
+                      std::ofstream            *timeline)
+        : quanta(0),
+          _controller(controller),
+          _cores(cores),
+          _quantum(quantum),
+          _num_workers(num_workers),
+          _boundary(quantum),
+          _done(false),
+          _timeline(timeline),
+          _barrier(num_workers) {}
+
+    // worker body, lane 0 also resolves the boundaries
+    void run(uint32_t lane)
+    {
+        for (;;)
+        {
+            for (uint32_t pid = lane; pid < _cores.size(); pid += _num_workers) {
+                advance(_cores[pid], pid, lane);
+            }
+            _barrier.wait();
+            if (lane == 0) {
+                resolve();
+            }
+            _barrier.wait();
+            if (_done) {
+                return;
+            }
+        }
+    }
+
+    std::string stats_to_string()
+    {
+        std::stringstream out;
+        uint64_t cycles = 0;
+        out << "Core Timeline (quantum " << _quantum << " cycles, " << quanta << " quanta):" << std::endl;
+        out << std::setw(15) << std::left << "Processor"
+            << std::setw(15) << std::left << "Cycles"
+            << std::setw(15) << std::left << "Accesses"
+            << std::setw(15) << std::left << "In-Quantum"
+            << std::setw(15) << std::left << "At-Boundary" << std::endl;
+        for (uint32_t pid = 0; pid < _cores.size(); ++pid)
+        {
+            const Core_Stream &core = _cores[pid];
+            cycles = std::max(cycles, core.clock);
+            out << std::setw(15) << std::left << pid
+                << std::setw(15) << std::left << core.clock
+                << std::setw(15) << std::left << core.accesses
+                << std::setw(15) << std::left << core.local
+                << std::setw(15) << std::left << (core.accesses - core.local) << std::endl;
+        }
+        out << "Simulated-Cycles: " << cycles << std::endl << std::endl;
+        return out.str();
+    }
+
+public:
+    uint64_t quanta;
+
+private:
+    // simulate the accesses of a core up to the boundary or its first directory transaction
+    inline void advance(Core_Stream &core, uint32_t pid, uint32_t lane)
+    {
+        while (core.clock < _boundary && !core.blocked && core.next_event())
+        {
+            uint64_t cost;
+            const Trace_Event &event = core.event;
+            if (!_controller.local_single_line(event.addr, pid, event.flags & TRACE_WRITE,
+                                               event.flags & TRACE_PRIVATE, cost, lane))
+            {
+                core.blocked = true;
+                break;
+            }
+            core.retire(cost);
+            ++core.local;
+        }
+    }
+
+    // simulate the blocked accesses in deterministic order and pick the next boundary
+    inline void resolve()
+    {
+        ++quanta;
+        _controller.coherence->profiles->commit_line_hits();
+        std::vector<std::pair<uint64_t, uint32_t>> blocked;  // clock -> processor id
+        for (uint32_t pid = 0; pid < _cores.size(); ++pid)
+        {
+            if (_cores[pid].blocked) {
+                blocked.push_back(std::make_pair(_cores[pid].clock, pid));
+            }
+        }
+        std::sort(blocked.begin(), blocked.end());
+
+        for (const auto &p : blocked)
+        {
+            uint32_t pid = p.second;
+            Core_Stream &core = _cores[pid];
+            const Trace_Event &event = core.event;
+            uint64_t cost;
+            if (event.flags & TRACE_PRIVATE) {
+                cost = _controller.private_single_line(event.addr, pid);
+            } else if (event.flags & TRACE_WRITE) {
+                cost = _controller.store_single_line(event.addr, pid, 0, event.pc);
+            } else {
+                cost = _controller.load_single_line(event.addr, pid);
+            }
+            core.blocked = false;
+            core.retire(cost);
+        }
+
+        if (_timeline)
+        {
+            for (uint32_t pid = 0; pid < _cores.size(); ++pid)
+            {
+                *_timeline << _boundary << "," << pid << "," << _cores[pid].clock << ","
+                           << _cores[pid].accesses << "\n";
+            }
+        }
+
+        // NOTE: skip quanta in which no core would run
+        uint64_t earliest = ALL_ONES;
+        for (auto &core : _cores)
+        {
+            if (core.next_event()) {
+                earliest = std::min(earliest, core.clock);
+            }
+        }
+        if (earliest == ALL_ONES) {
+            _done = true;
+        } else {
+            _boundary = (earliest / _quantum + 1) * _quantum;
+        }
+    }
+
+private:
+    Controller &_controller;
+    std::vector<Core_Stream> &_cores;
+    uint64_t _quantum;
+    uint32_t _num_workers;
+    uint64_t _boundary;  // end of the current quantum
+    bool _done;
+    std::ofstream *_timeline;
+    Barrier _barrier;
+};
+
+int main(int argc, char *argv[])
+{
+    std::string config_file = "cache.config";
+    std::string output_file = "cache.out";
+    std::string trace_file;
+    uint32_t num_workers = 1;
+    uint32_t num_shards = 64;
+    uint32_t top_lines = HOT_LINES;
+    uint32_t line_counters = LINE_COUNTERS;
+    uint64_t quantum = 0;
+    uint32_t mrc_sets = 0;
+    uint32_t spin = 0;
+    std::string timeline_file;
+    bool specialize = true;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "-c" && i + 1 < argc) {
+            config_file = argv[++i];
+        } else if (arg == "-o" && i + 1 < argc) {
+            output_file = argv[++i];
+        } else if (arg == "-j" && i + 1 < argc) {
+            num_workers = std::max(atoi(argv[++i]), 1);
+        } else if (arg == "-quantum" && i + 1 < argc) {
+            quantum = strtoull(argv[++i], NULL, 0);
+        } else if (arg == "-mrc" && i + 1 < argc) {
+            mrc_sets = atoi(argv[++i]);
+        } else if (arg == "-timeline" && i + 1 < argc) {
+            timeline_file = argv[++i];
+        } else if (arg == "-shards" && i + 1 < argc) {
+            num_shards = atoi(argv[++i]);
+        } else if (arg == "-top_lines" && i + 1 < argc) {
+            top_lines = atoi(argv[++i]);
+        } else if (arg == "-line_counters" && i + 1 < argc) {
+            line_counters = std::max(atoi(argv[++i]), 1);
+        } else if (arg == "-spin" && i + 1 < argc) {
+            spin = atoi(argv[++i]);
+        } else if (arg == "-generic") {
+            specialize = false;
+        } else if (trace_file.empty() && arg[0] != '-') {
+            trace_file = arg;
+        } else {
+            return usage();
+        }
+    }
+    if (trace_file.empty() || num_shards == 0 || (num_shards & (num_shards - 1)) != 0 ||
+        (mrc_sets & (mrc_sets - 1)) != 0 || (mrc_sets > 0 && (num_workers > 1 || quantum > 0)) ||
+        (spin > 0 && (num_workers > 1 || quantum > 0)))
+    {
+        return usage();
+    }
+
+    std::vector<CACHE_CONFIG> configs;
+    std::string error;
+    FILE *config = fopen(config_file.c_str(), "r");
+    if (config == NULL || !read_cache_configs(config, configs, error))
+    {
+        std::cerr << "Cannot read configuration file : " << config_file << " (" << error << ")" << std::endl;
+        return -1;
+    }
+    fclose(config);
+    if (configs.size() > 1)
+    {
+        std::cerr << "Replaying the first of " << configs.size() << " configurations" << std::endl;
+    }
+    if (num_workers > 1 && quantum == 0)
+    {
+        std::cerr << "NOTE: -j without -quantum interleaves the workers in host order, the report "
+                  << "differs from the serial one and from run to run" << std::endl;
+    }
+    const CACHE_CONFIG &l1_config = configs[0];
+    std::cerr << cache_config_string(l1_config) << std::endl;
+
+    int fd = open(trace_file.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror(trace_file.c_str());
+        return -1;
+    }
+    size_t size = st.st_size;
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    const uint8_t *data = static_cast<const uint8_t *>(mapped);
+
+    std::vector<CHUNK_REF> chunks;
+    if (!index_chunks(data, size, chunks))
+    {
+        std::cerr << "Malformed trace : " << trace_file << std::endl;
+        return -1;
+    }
+    std::sort(chunks.begin(), chunks.end(),
+              [](const CHUNK_REF &a, const CHUNK_REF &b) { return a.seq < b.seq; });
+
+    num_processors = l1_config.total_processors;
+    assign_pids(chunks);
+
+    std::deque<Thread_Stream> threads;
+    split_threads(chunks, threads);
+
+    // NOTE: threads of one processor stay on one worker, keeping its program order
+    std::vector<Merged_Stream> streams(num_workers);
+    std::vector<Core_Stream> cores(quantum > 0 ? num_processors : 0);
+    for (auto &thread : threads)
+    {
+        if (quantum > 0) {
+            cores[thread.pid].stream.add(&thread);
+        } else {
+            streams[thread.pid % num_workers].add(&thread);
+        }
+    }
+
+    bool parallel = num_workers > 1;
+    Controller *target = make_controller(l1_config.total_processors,
+                                         l1_config.num_sets,
+                                         l1_config.line_size,
+                                         l1_config.set_size,
+                                         (parallel || quantum > 0) ? num_shards : 1,
+                                         num_workers,
+                                         specialize);
+    Controller &controller = *target;
+    controller.coherence->set_protocol(protocol_of(l1_config.protocol, l1_config.detector));
+    controller.set_replacement(l1_config.replacement);
+    if (l1_config.dir_entries)
+    {
+        controller.enable_sparse_directory(l1_config.dir_entries, l1_config.dir_assoc);
+    }
+    if (l1_config.predictor_entries)
+    {
+        controller.coherence->enable_predictor(l1_config.predictor_entries, l1_config.predictor_assoc,
+                                               l1_config.predictor_index, l1_config.predictor_bits,
+                                               l1_config.predictor_threshold, l1_config.predictor_hysteresis,
+                                               l1_config.predictor_decay);
+    }
+    if (l1_config.l2_sets || l1_config.llc_sets)
+    {
+        controller.enable_hierarchy(l1_config.l2_sets, l1_config.l2_assoc, l1_config.llc_sets,
+                                    l1_config.llc_assoc, l1_config.inclusion, l1_config.push_target);
+    }
+    controller.track_hot_lines(top_lines, line_counters);
+    if (quantum > 0)
+    {
+        // NOTE: the cores of a quantum run on several workers, keep their hits in core order
+        controller.coherence->profiles->defer_line_hits();
+    }
+    if (mrc_sets > 0)
+    {
+        controller.enable_miss_ratio_curves(mrc_sets);
+    }
+    if (spin > 0)
+    {
+        controller.enable_spin_collapse(spin);
+    }
+    for (uint32_t lane = 1; lane < num_workers; ++lane)
+    {
+        controller.attach_lane(lane);
+    }
+
+    std::ofstream timeline;
+    if (!timeline_file.empty())
+    {
+        timeline.open(timeline_file.c_str());
+        timeline << "boundary,processor,cycles,accesses\n";
+    }
+    Quantum_Scheduler scheduler(controller, cores, quantum, num_workers,
+                                timeline.is_open() ? &timeline : nullptr);
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t accesses = 0;
+    if (quantum > 0)
+    {
+        std::vector<std::thread> workers;
+        for (uint32_t lane = 1; lane < num_workers; ++lane)
+        {
+            workers.push_back(std::thread([&, lane]() { scheduler.run(lane); }));
+        }
+        scheduler.run(0);
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        for (const auto &core : cores) {
+            accesses += core.accesses;
+        }
+    }
+    else if (!parallel)
+    {
+        accesses = replay_stream(controller, streams[0], 0);
+    }
+    else
+    {
+        std::vector<uint64_t> counts(num_workers, 0);
+        std::vector<std::thread> workers;
+        for (uint32_t lane = 0; lane < num_workers; ++lane)
+        {
+            workers.push_back(std::thread([&, lane]() {
+                counts[lane] = replay_stream(controller, streams[lane], lane);
+            }));
+        }
+        for (uint32_t lane = 0; lane < num_workers; ++lane)
+        {
+            workers[lane].join();
+            accesses += counts[lane];
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::ofstream out(output_file.c_str());
+    out << controller.stats_to_string();
+    if (quantum > 0) {
+        out << scheduler.stats_to_string();
+    }
+    out.close();
+
+    std::cerr << "Replayed " << accesses << " accesses from " << chunks.size() << " chunks on "
+              << num_workers << " thread(s) in "
+              << elapsed.count() << "s (" << (accesses / elapsed.count() / 1e6) << "M accesses/s)"
+              << std::endl;
+
+    delete target;
+    munmap(mapped, size);
+    close(fd);
+    return 0;
+}
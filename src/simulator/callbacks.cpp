@@ -1,17 +1,128 @@
 #include "callbacks.H"
 
+#include <algorithm>
+#include <unordered_set>
+
 extern KNOB<string> KnobOutputFile;
 extern KNOB<BOOL>   KnobNoSharedLibs;
+extern KNOB<UINT32> KnobBufferSize;
+extern KNOB<string> KnobDrainOrder;
+extern KNOB<string> KnobFilter;
+extern KNOB<string> KnobRecordFile;
+extern KNOB<UINT32> KnobL0Entries;
+extern KNOB<UINT32> KnobTopLines;
+extern KNOB<UINT32> KnobLineCounters;
+extern KNOB<UINT32> KnobSpin;
+extern KNOB<BOOL>   KnobParallel;
+extern KNOB<UINT32> KnobShards;
+extern KNOB<UINT32> KnobWorkers;
+extern KNOB<UINT32> KnobMissRatioSets;
 extern CACHE_CONFIG l1_config;
+extern std::vector<CACHE_CONFIG> cache_configs;
 
-int32_t lock_id = 1;
 uint32_t next_pid = 0;
 uint32_t num_processors;  // NOTE: number of processor is power of 2
 
-Controller * controller = nullptr;
+Controller * controller = nullptr;      // first configuration, the only one the L0 filter serves
+std::vector<Controller *> controllers;  // one per configuration, fed in lockstep
 std::unordered_map<uint32_t, uint32_t> t_map;  // thread id -> processor id
 PIN_LOCK mapLock;
 
+// buffered mode, records are only merged in timestamp order with '-drain tsc'
+bool tsc_order = false;
+std::vector<std::pair<ACCESS_RECORD, uint32_t>> pending;  // min-heap on tsc: record -> processor id
+std::unordered_map<uint32_t, uint64_t> watermark;           // thread id -> tsc of last drained record
+std::unordered_set<uint32_t> exited;                        // threads whose final buffer is still to drain
+
+// '-workers', accesses are broadcast to simulation threads that own a subset of configurations
+typedef enum
+{
+    SIM_LOAD,
+    SIM_STORE,
+    SIM_PRIVATE
+} SIM_KIND;
+
+typedef struct
+{
+    UINT64  addr;
+    UINT64  pc;
+    UINT32  pid;
+    UINT32  kind;
+} SIM_ACCESS;
+
+const UINT32 RING_ENTRIES = 1 << 16;
+
+Broadcast_Ring<SIM_ACCESS> * access_ring = nullptr;
+std::vector<PIN_THREAD_UID> worker_uids;
+uint32_t num_workers = 0;
+
+// parallel mode, every thread simulates on its own lane without mapLock
+bool parallel = false;
+uint32_t t_pid[PIN_MAX_THREADS];   // thread id -> processor id, written under mapLock at thread start
+uint32_t t_lane[PIN_MAX_THREADS];  // thread id -> lane, written under mapLock at thread start
+std::vector<bool> lane_busy;       // lanes of running threads, a free lane is reused before adding one
+
+// filtered accesses, counted per thread to keep '-filter skip' free of lock traffic
+typedef struct
+{
+    UINT64 count[FILTER_CLASSES];
+    UINT8  pad[64 - sizeof(UINT64) * FILTER_CLASSES];
+} FILTER_COUNTER;
+
+FILTER_COUNTER filter_counters[PIN_MAX_THREADS];
+UINT64 filtered_operands[FILTER_CLASSES];  // NOTE: updated at instrumentation time
+
+/* ===================================================================== */
+/*  L0 filter - per-thread direct-mapped table of addresses the thread   */
+/*  may access again without a directory transaction. Entries are        */
+/*  checked inline by l0_load/l0_store and revoked by the directory.     */
+/*  The checks write only the thread's own filter, l0_apply_all() moves */
+/*  the hits into the LFU counters before the next simulated access.     */
+/*  With a packed replacement policy l0_load_packed/l0_store_packed hit  */
+/*  only while the use would leave the state of the set unchanged.       */
+/* ===================================================================== */
+const ADDRINT L0_EMPTY = ~static_cast<ADDRINT>(0);
+
+typedef struct
+{
+    ADDRINT     addr;        // L0_EMPTY once revoked
+    UINT64      write;       // 1 if stores hit as well
+    UINT64      *tag_slot;   // tag of the backing cache line, valid while it equals tag
+    UINT64      *state_slot; // LFU counter of the line, or the packed state of its set
+    UINT64      state_mask;  // packed policies, hits while (*state_slot & state_mask) == state_value
+    UINT64      state_value;
+    UINT64      tag;
+    ADDRINT     stat_addr;   // address the hit counters below belong to
+    UINT64      load_hits;
+    UINT64      store_hits;
+    UINT64      applied;     // hits already added to the LFU counter, NOTE: written under mapLock
+} L0_ENTRY;
+
+class L0_Filter
+{
+public:
+    L0_Filter(uint32_t num_entries)
+        : entries(new L0_ENTRY[num_entries]), pending(0), sentinel_tag(ALL_ONES), sentinel_state(0) {}
+    ~L0_Filter() { delete [] entries; }
+
+public:
+    L0_ENTRY    *entries;
+    UINT64      pending;        // hits since the last l0_apply()
+    UINT64      sentinel_tag;   // backs empty entries, NOTE: never matches an entry tag
+    UINT64      sentinel_state;
+    UINT8       pad[64];        // keep the sentinel off other threads' cache lines
+};
+
+L0_Filter * l0_filters[PIN_MAX_THREADS];
+ADDRINT l0_mask = 0;
+uint64_t l0_hits = 0;
+uint64_t l0_misses = 0;
+
+inline L0_ENTRY & l0_entry(uint32_t tid, ADDRINT addr)
+{
+    return l0_filters[tid]->entries[(addr >> 3) & l0_mask];
+}
+
 inline uint32_t get_pid(uint32_t tid)
 {
     assert(t_map.find(tid) != t_map.end());
@@ -28,60 +139,700 @@ inline uint32_t get_next_pid()
     return next_pid == num_processors ? 0 : next_pid++;
 }
 
-void cache_load(UINT32 tid, ADDRINT pin_addr)
+inline bool buffered()
+{
+    return KnobBufferSize.Value() > 0;
+}
+
+inline bool recording()
+{
+    return !KnobRecordFile.Value().empty();
+}
+
+inline bool workers_enabled()
+{
+    return KnobWorkers.Value() > 0 && !KnobParallel.Value() && !recording();
+}
+
+// NOTE: also decides the instrumentation, see insert_access()
+bool l0_enabled()
+{
+    return KnobL0Entries.Value() > 0 && !buffered() && !recording() && !KnobParallel.Value()
+        && !workers_enabled() && cache_configs.size() == 1 && KnobMissRatioSets.Value() == 0
+        && KnobSpin.Value() == 0;
+}
+
+// filter checks of the replacement policy, LFU counts hits into the line's counter
+bool l0_packed()
+{
+    return cache_configs[0].replacement != REPLACEMENT::LFU;
+}
+
+inline void simulate_on(Controller *target, uint64_t addr, uint32_t pid, uint32_t kind, uint32_t lane, uint64_t pc)
+{
+    if (kind == SIM_PRIVATE) {
+        target->private_single_line(addr, pid, lane);
+    } else if (kind == SIM_STORE) {
+        target->store_single_line(addr, pid, lane, pc);
+    } else {
+        target->load_single_line(addr, pid, lane, pc);
+    }
+}
+
+// feed an access to every configuration, NOTE: caller holds mapLock unless parallel
+inline void simulate_access(uint64_t addr, uint32_t pid, uint32_t kind, uint32_t lane = 0, uint64_t pc = 0)
+{
+    if (access_ring != nullptr)
+    {
+        SIM_ACCESS access = {addr, pc, pid, kind};
+        access_ring->push(access);
+        return;
+    }
+    for (auto target : controllers) {
+        simulate_on(target, addr, pid, kind, lane, pc);
+    }
+}
+
+inline void simulate(const ACCESS_RECORD &record, uint32_t pid)
 {
-    PIN_GetLock(&mapLock, lock_id++);
+    uint32_t kind = (record.filter != FILTER_NONE) ? SIM_PRIVATE : (record.is_write ? SIM_STORE : SIM_LOAD);
+    simulate_access(record.addr, pid, kind, 0, record.pc);
+}
+
+inline bool later(const std::pair<ACCESS_RECORD, uint32_t> &a,
+                  const std::pair<ACCESS_RECORD, uint32_t> &b)
+{
+    return a.first.tsc > b.first.tsc;
+}
+
+// simulate staged records no thread can still precede, NOTE: caller holds mapLock
+inline void commit_pending(uint64_t bound)
+{
+    while (!pending.empty() && pending.front().first.tsc <= bound)
+    {
+        std::pop_heap(pending.begin(), pending.end(), later);
+        simulate(pending.back().first, pending.back().second);
+        pending.pop_back();
+    }
+}
+
+void cache_load(UINT32 tid, ADDRINT pin_addr, ADDRINT pc)
+{
+    PIN_GetLock(&mapLock, tid + 1);
     uint64_t addr = reinterpret_cast<UINT64>(pin_addr);
     uint32_t pid = get_pid(tid);
-    controller->load_single_line(addr, pid);
+    simulate_access(addr, pid, SIM_LOAD, 0, pc);
     PIN_ReleaseLock(&mapLock);
 }
 
-void cache_store(UINT32 tid, ADDRINT pin_addr)
+void cache_store(UINT32 tid, ADDRINT pin_addr, ADDRINT pc)
 {
-    PIN_GetLock(&mapLock, lock_id++);
+    PIN_GetLock(&mapLock, tid + 1);
     uint64_t addr = reinterpret_cast<UINT64>(pin_addr);
     uint32_t pid = get_pid(tid);
-    controller->store_single_line(addr, pid);
+    simulate_access(addr, pid, SIM_STORE, 0, pc);
+    PIN_ReleaseLock(&mapLock);
+}
+
+// NOTE: directory shards and private caches are locked inside the controller
+void parallel_load(UINT32 tid, ADDRINT pin_addr, ADDRINT pc)
+{
+    uint64_t addr = reinterpret_cast<UINT64>(pin_addr);
+    simulate_access(addr, t_pid[tid], SIM_LOAD, t_lane[tid], pc);
+}
+
+void parallel_store(UINT32 tid, ADDRINT pin_addr, ADDRINT pc)
+{
+    uint64_t addr = reinterpret_cast<UINT64>(pin_addr);
+    simulate_access(addr, t_pid[tid], SIM_STORE, t_lane[tid], pc);
+}
+
+// account the hits collected by an entry, NOTE: caller holds mapLock
+inline void l0_flush(L0_ENTRY &entry, uint32_t pid)
+{
+    uint64_t hits = entry.load_hits + entry.store_hits;
+    if (hits == 0) {
+        return;
+    }
+
+    // NOTE: same cost as DIR_MSI::fetch() on a sharer
+    uint64_t hops = 0;
+    uint32_t home = controller->coherence->get_home_node(entry.stat_addr);
+    uint64_t cost = controller->coherence->get_directory_cost(pid, home, hops) + LOCAL_CACHE_ACCESS;
+    controller->coherence->profiles->profile_cache_hits(pid, entry.stat_addr, entry.load_hits,
+                                                        entry.store_hits, cost, hops);
+    l0_hits += hits;
+    entry.load_hits = 0;
+    entry.store_hits = 0;
+    entry.applied = 0;
+}
+
+// add the hits a thread's entries took since its last call to the LFU counters of the
+// lines still cached
+// NOTE: caller holds mapLock, hits on a line evicted meanwhile are dropped with it. A hit
+//       counted while another thread clears pending waits for the owner's next hit.
+inline void l0_apply(uint32_t tid)
+{
+    L0_Filter *filter = l0_filters[tid];
+    if (filter->pending == 0) {
+        return;
+    }
+    filter->pending = 0;
+    L0_ENTRY *entries = filter->entries;
+    for (ADDRINT i = 0; i <= l0_mask; ++i)
+    {
+        L0_ENTRY &entry = entries[i];
+        uint64_t hits = entry.load_hits + entry.store_hits;
+        if (hits != entry.applied && *entry.tag_slot == entry.tag) {
+            *entry.state_slot += hits - entry.applied;
+        }
+        entry.applied = hits;
+    }
+}
+
+// apply every thread's hits before an access is simulated, it may replace lines in any
+// core's cache since the detector fills the qualified readers
+// NOTE: caller holds mapLock
+inline void l0_apply_all()
+{
+    for (const auto &p : t_map)
+    {
+        if (l0_filters[p.first] != nullptr) {
+            l0_apply(p.first);
+        }
+    }
+}
+
+inline void l0_clear(L0_ENTRY &entry, uint32_t tid)
+{
+    entry.addr = L0_EMPTY;
+    entry.write = 0;
+    entry.tag_slot = &l0_filters[tid]->sentinel_tag;
+    entry.state_slot = &l0_filters[tid]->sentinel_state;
+    entry.state_mask = 0;
+    entry.state_value = 0;
+    entry.tag = 0;
+}
+
+// refill the entry for addr after a full simulation, NOTE: caller holds mapLock
+inline void l0_fill(uint32_t tid, uint32_t pid, ADDRINT addr)
+{
+    L0_ENTRY &entry = l0_entry(tid, addr);
+    l0_flush(entry, pid);
+    l0_clear(entry, tid);
+    ++l0_misses;
+
+    uint32_t slot = controller->find_cache_line(pid, addr);
+    if (slot != NO_SLOT && controller->coherence->has_read_permission(pid, addr))
+    {
+        Cache &cache = *controller->cache[pid];
+        entry.addr = addr;
+        entry.write = controller->coherence->has_write_permission(pid, addr);
+        entry.tag_slot = cache.tag_word(slot);
+        if (!cache.touched_state(l1_config.set_size, slot, entry.state_slot, entry.state_mask, entry.state_value)) {
+            entry.state_slot = cache.lru_word(slot);
+        }
+        entry.tag = *entry.tag_slot;
+        entry.stat_addr = addr;
+    }
+}
+
+class L0_Revoker : public Coherence_Listener
+{
+public:
+    void on_invalidate(uint32_t pid, uint64_t addr) { revoke(pid, addr, false, false); }
+    void on_downgrade(uint32_t pid, uint64_t addr)  { revoke(pid, addr, true, false); }
+    void on_evict(uint32_t pid, uint64_t addr)      { revoke(pid, addr, false, true); }
+
+private:
+    // revoke every entry of the directory line holding addr, an evicted line also
+    // unhooks the entries from its slot so that l0_apply() drops their hits
+    // NOTE: called under mapLock, the owning thread may hit concurrently
+    inline void revoke(uint32_t pid, uint64_t addr, bool write_only, bool evicted)
+    {
+        ADDRINT line_mask = ~static_cast<ADDRINT>(l1_config.line_size - 1);
+        ADDRINT line = addr & line_mask;
+        for (const auto &p : t_map)
+        {
+            if (p.second != pid || l0_filters[p.first] == nullptr) {
+                continue;
+            }
+            for (ADDRINT granule = line; granule < line + l1_config.line_size; granule += 8)
+            {
+                L0_ENTRY &entry = l0_entry(p.first, granule);
+                if ((entry.stat_addr & line_mask) != line) {
+                    continue;
+                }
+                if (write_only) {
+                    entry.write = 0;
+                } else {
+                    entry.addr = L0_EMPTY;
+                }
+                if (evicted) {
+                    entry.tag_slot = &l0_filters[p.first]->sentinel_tag;
+                    entry.state_slot = &l0_filters[p.first]->sentinel_state;
+                }
+            }
+        }
+    }
+};
+
+L0_Revoker l0_revoker;
+
+// inlined filter check, returns non-zero when the access needs the full simulator
+// NOTE: reads the backing line's tag without mapLock and writes the thread's own filter
+//       only. The LFU counters get the hits from l0_apply_all() before the next access
+//       is simulated, so replacement sees the same counts as an unfiltered run.
+ADDRINT PIN_FAST_ANALYSIS_CALL l0_load(THREADID tid, ADDRINT addr)
+{
+    L0_ENTRY &entry = l0_entry(tid, addr);
+    UINT64 hit = (entry.addr == addr) & (*entry.tag_slot == entry.tag);
+    entry.load_hits += hit;
+    l0_filters[tid]->pending += hit;
+    return hit ^ 1;
+}
+
+ADDRINT PIN_FAST_ANALYSIS_CALL l0_store(THREADID tid, ADDRINT addr)
+{
+    L0_ENTRY &entry = l0_entry(tid, addr);
+    UINT64 hit = (entry.addr == addr) & entry.write & (*entry.tag_slot == entry.tag);
+    entry.store_hits += hit;
+    l0_filters[tid]->pending += hit;
+    return hit ^ 1;
+}
+
+// NOTE: a hit that would move the line in its set takes the full simulator, so the hits
+//       taken here leave nothing for l0_apply()
+ADDRINT PIN_FAST_ANALYSIS_CALL l0_load_packed(THREADID tid, ADDRINT addr)
+{
+    L0_ENTRY &entry = l0_entry(tid, addr);
+    UINT64 hit = (entry.addr == addr) & (*entry.tag_slot == entry.tag)
+               & ((*entry.state_slot & entry.state_mask) == entry.state_value);
+    entry.load_hits += hit;
+    return hit ^ 1;
+}
+
+ADDRINT PIN_FAST_ANALYSIS_CALL l0_store_packed(THREADID tid, ADDRINT addr)
+{
+    L0_ENTRY &entry = l0_entry(tid, addr);
+    UINT64 hit = (entry.addr == addr) & entry.write & (*entry.tag_slot == entry.tag)
+               & ((*entry.state_slot & entry.state_mask) == entry.state_value);
+    entry.store_hits += hit;
+    return hit ^ 1;
+}
+
+void l0_cache_load(UINT32 tid, ADDRINT pin_addr, ADDRINT pc)
+{
+    PIN_GetLock(&mapLock, tid + 1);
+    uint64_t addr = reinterpret_cast<UINT64>(pin_addr);
+    uint32_t pid = get_pid(tid);
+    l0_apply_all();
+    controller->load_single_line(addr, pid, 0, pc);
+    l0_fill(tid, pid, addr);
+    PIN_ReleaseLock(&mapLock);
+}
+
+void l0_cache_store(UINT32 tid, ADDRINT pin_addr, ADDRINT pc)
+{
+    PIN_GetLock(&mapLock, tid + 1);
+    uint64_t addr = reinterpret_cast<UINT64>(pin_addr);
+    uint32_t pid = get_pid(tid);
+    l0_apply_all();
+    controller->store_single_line(addr, pid, 0, pc);
+    l0_fill(tid, pid, addr);
+    PIN_ReleaseLock(&mapLock);
+}
+
+// account and release the filter of a thread, NOTE: caller holds mapLock
+inline void l0_detach(uint32_t tid)
+{
+    if (l0_filters[tid] == nullptr) {
+        return;
+    }
+    uint32_t pid = get_pid(tid);
+    l0_apply(tid);
+    for (ADDRINT i = 0; i <= l0_mask; ++i)
+    {
+        l0_flush(l0_filters[tid]->entries[i], pid);
+    }
+    delete l0_filters[tid];
+    l0_filters[tid] = nullptr;
+}
+
+// thread-private access, occupies the private cache but bypasses the directory
+void cache_private_access(UINT32 tid, ADDRINT pin_addr, UINT32 filter)
+{
+    ++filter_counters[tid].count[filter];
+    uint64_t addr = reinterpret_cast<UINT64>(pin_addr);
+    if (parallel) {
+        simulate_access(addr, t_pid[tid], SIM_PRIVATE, t_lane[tid]);
+        return;
+    }
+
+    PIN_GetLock(&mapLock, tid + 1);
+    if (l0_filters[tid] != nullptr) {
+        l0_apply_all();
+    }
+    simulate_access(addr, get_pid(tid), SIM_PRIVATE);
+    PIN_ReleaseLock(&mapLock);
+}
+
+VOID PIN_FAST_ANALYSIS_CALL count_filtered(THREADID tid, UINT32 filter)
+{
+    ++filter_counters[tid].count[filter];
+}
+
+inline std::string filter_stats_to_string()
+{
+    static const char *names[FILTER_CLASSES] = {"Unfiltered", "Stack", "TLS", "Read-Only"};
+    std::stringstream out;
+    out << "Filtered Accesses (" << KnobFilter.Value() << "):" << std::endl;
+    out << std::setw(15) << std::left << "Class"
+        << std::setw(15) << std::left << "Operands"
+        << std::setw(15) << std::left << "Accesses" << std::endl;
+
+    for (uint32_t filter = FILTER_STACK; filter < FILTER_CLASSES; ++filter)
+    {
+        UINT64 accesses = 0;
+        for (uint32_t tid = 0; tid < PIN_MAX_THREADS; ++tid)
+        {
+            accesses += filter_counters[tid].count[filter];
+        }
+        out << std::setw(15) << std::left << names[filter]
+            << std::setw(15) << std::left << filtered_operands[filter]
+            << std::setw(15) << std::left << accesses << std::endl;
+    }
+    out << std::setw(15) << std::left << names[FILTER_NONE]
+        << std::setw(15) << std::left << filtered_operands[FILTER_NONE] << std::endl;
+    return out.str();
+}
+
+// called by Pin when a thread's access buffer is full and when the thread exits
+VOID * drain_buffer(BUFFER_ID id,
+                    THREADID  tid,
+                    const CONTEXT *ctxt,
+                    VOID      *buf,
+                    UINT64    num_elements,
+                    VOID      *v)
+{
+    const ACCESS_RECORD *records = static_cast<const ACCESS_RECORD *>(buf);
+
+    PIN_GetLock(&mapLock, tid + 1);
+    uint32_t pid = get_pid(tid);
+    // NOTE: Pin drains an exiting thread's last buffer after its fini callback
+    bool last = exited.erase(tid) > 0;
+    if (!tsc_order)
+    {
+        // per-thread program order, threads interleave at buffer granularity
+        for (UINT64 i = 0; i < num_elements; ++i)
+        {
+            filter_counters[tid].count[records[i].filter] += (records[i].filter != FILTER_NONE);
+            simulate(records[i], pid);
+        }
+    }
+    else
+    {
+        for (UINT64 i = 0; i < num_elements; ++i)
+        {
+            filter_counters[tid].count[records[i].filter] += (records[i].filter != FILTER_NONE);
+            pending.push_back(std::make_pair(records[i], pid));
+            std::push_heap(pending.begin(), pending.end(), later);
+        }
+
+        // NOTE: a thread bounds the merge until its final buffer is staged, later
+        //       records of the other threads wait for it
+        if (last) {
+            watermark.erase(tid);
+        } else if (num_elements > 0) {
+            watermark[tid] = records[num_elements - 1].tsc;
+        }
+
+        uint64_t bound = ALL_ONES;
+        for (const auto &p : watermark)
+        {
+            bound = std::min(bound, p.second);
+        }
+        commit_pending(bound);
+
+        // a blocked thread stalls the merge, relax ordering rather than grow without bound
+        uint64_t limit = 4 * KnobBufferSize.Value() * std::max<size_t>(watermark.size(), 1);
+        while (pending.size() > limit)
+        {
+            commit_pending(pending.front().first.tsc);
+        }
+    }
+
+    // the thread is gone once its final buffer is drained, a reused id gets a new processor
+    if (last)
+    {
+        t_map.erase(tid);
+    }
+    PIN_ReleaseLock(&mapLock);
+
+    return buf;
+}
+
+// simulation thread, replays the ring on the configurations it owns
+VOID worker_main(VOID *arg)
+{
+    uint32_t reader = static_cast<uint32_t>(reinterpret_cast<ADDRINT>(arg));
+    const SIM_ACCESS *first;
+    uint64_t count;
+    while (access_ring->acquire(reader, first, count))
+    {
+        for (size_t i = reader; i < controllers.size(); i += num_workers)
+        {
+            for (uint64_t j = 0; j < count; ++j) {
+                simulate_on(controllers[i], first[j].addr, first[j].pid, first[j].kind, 0, first[j].pc);
+            }
+        }
+        access_ring->release(reader, count);
+    }
+}
+
+// let the workers finish the ring, later accesses are simulated by the application threads
+// NOTE: called before Pin waits for internal threads
+void workers_prepare_detach()
+{
+    PIN_GetLock(&mapLock, get_current_tid() + 1);
+    if (access_ring != nullptr)
+    {
+        access_ring->close();
+        for (auto uid : worker_uids) {
+            PIN_WaitForThreadTermination(uid, PIN_INFINITE_TIMEOUT, NULL);
+        }
+        delete access_ring;
+        access_ring = nullptr;
+    }
+    PIN_ReleaseLock(&mapLock);
+}
+
+// side-by-side totals of all configurations
+inline std::string comparison_to_string()
+{
+    std::stringstream out;
+    out << "Configuration Comparison:" << std::endl;
+    out << std::setw(20) << std::left << "Configuration"
+        << std::setw(12) << std::left << "Hit-Rate"
+        << std::setw(15) << std::left << "Load-Misses"
+        << std::setw(15) << std::left << "Store-Misses"
+        << std::setw(15) << std::left << "Evicts"
+        << std::setw(15) << std::left << "Cycles"
+        << std::setw(15) << std::left << "Network-Msg"
+        << std::setw(10) << std::left << "Cycles/1st" << std::endl;
+
+    uint64_t first_cycles = 0;
+    for (size_t i = 0; i < controllers.size(); ++i)
+    {
+        Access_Stat total = controllers[i]->coherence->profiles->totals();
+        uint64_t hits = total.load.hits + total.store.hits + total.priv.hits;
+        uint64_t accesses = hits + total.load.misses + total.store.misses + total.priv.misses;
+        uint64_t cycles = total.load.hit_cycles + total.load.miss_cycles + total.store.hit_cycles
+                        + total.store.miss_cycles + total.priv.hit_cycles + total.priv.miss_cycles
+                        + total.evict.miss_cycles + total.dir_evict.miss_cycles;
+        if (i == 0) {
+            first_cycles = cycles;
+        }
+        out << std::setw(20) << std::left << cache_config_name(cache_configs[i])
+            << std::setw(12) << std::left << (100.0 * hits / accesses)
+            << std::setw(15) << std::left << total.load.misses
+            << std::setw(15) << std::left << total.store.misses
+            << std::setw(15) << std::left << total.evict.misses
+            << std::setw(15) << std::left << cycles
+            << std::setw(15) << std::left << (total.load.hops + total.store.hops + total.evict.hops + total.dir_evict.hops)
+            << std::setw(10) << std::left << (1.0 * cycles / first_cycles) << std::endl;
+    }
+    return out.str();
+}
+
+// simulate all records still staged for timestamp ordering
+void drain_pending()
+{
+    PIN_GetLock(&mapLock, get_current_tid() + 1);
+    commit_pending(ALL_ONES);
+    watermark.clear();
+    exited.clear();
     PIN_ReleaseLock(&mapLock);
 }
 
 void process_attach()
 {
-    PIN_GetLock(&mapLock, lock_id++);
+    PIN_GetLock(&mapLock, get_current_tid() + 1);
     num_processors = l1_config.total_processors;
-    controller = new Controller(l1_config.total_processors,
-                                l1_config.num_sets,
-                                l1_config.line_size,
-                                l1_config.set_size);
+    tsc_order = buffered() && (KnobDrainOrder.Value() == "tsc");
+    parallel = KnobParallel.Value() && !buffered() && !recording();
+    for (const auto &config : cache_configs)
+    {
+        Controller *target = make_controller(config.total_processors,
+                                            config.num_sets,
+                                            config.line_size,
+                                            config.set_size,
+                                            parallel ? KnobShards.Value() : 1,
+                                            parallel ? PIN_MAX_THREADS : 1);
+        target->coherence->set_protocol(protocol_of(config.protocol, config.detector));
+        target->set_replacement(config.replacement);
+        if (config.dir_entries) {
+            target->enable_sparse_directory(config.dir_entries, config.dir_assoc);
+        }
+        if (config.predictor_entries) {
+            target->coherence->enable_predictor(config.predictor_entries, config.predictor_assoc, config.predictor_index,
+                                                config.predictor_bits, config.predictor_threshold,
+                                                config.predictor_hysteresis, config.predictor_decay);
+        }
+        if (config.l2_sets || config.llc_sets) {
+            target->enable_hierarchy(config.l2_sets, config.l2_assoc, config.llc_sets, config.llc_assoc,
+                                     config.inclusion, config.push_target);
+        }
+        target->track_hot_lines(KnobTopLines.Value(), std::max(KnobLineCounters.Value(), 1u));
+        if (KnobSpin.Value() > 0 && !parallel) {
+            target->enable_spin_collapse(KnobSpin.Value());
+        }
+        controllers.push_back(target);
+    }
+    controller = controllers[0];
+    if (KnobMissRatioSets.Value() > 0 && !parallel)
+    {
+        controller->enable_miss_ratio_curves(KnobMissRatioSets.Value());
+    }
+
+    if (workers_enabled())
+    {
+        num_workers = std::min<size_t>(KnobWorkers.Value(), controllers.size());
+        access_ring = new Broadcast_Ring<SIM_ACCESS>(RING_ENTRIES, num_workers);
+        for (uint32_t i = 0; i < num_workers; ++i)
+        {
+            PIN_THREAD_UID uid;
+            if (PIN_SpawnInternalThread(worker_main, reinterpret_cast<VOID *>(static_cast<ADDRINT>(i)), 0, &uid) == INVALID_THREADID)
+            {
+                cerr << "Cannot spawn simulation worker thread\n";
+                exit(-1);
+            }
+            worker_uids.push_back(uid);
+        }
+    }
+    if (recording())
+    {
+        recorder_attach();
+    }
+    if (l0_enabled())
+    {
+        l0_mask = KnobL0Entries.Value() - 1;
+        controller->coherence->listeners.push_back(&l0_revoker);
+    }
     PIN_ReleaseLock(&mapLock);
 }
 
 void process_detach()
 {
-    PIN_GetLock(&mapLock, lock_id++);
+    drain_pending();
+
+    PIN_GetLock(&mapLock, get_current_tid() + 1);
+    for (const auto &p : t_map)
+    {
+        l0_detach(p.first);
+    }
+
     std::ofstream out(KnobOutputFile.Value().c_str());
-    out << controller->stats_to_string();
-    delete controller;
+    if (recording()) {
+        out << recorder_detach();
+    } else if (controllers.size() == 1) {
+        out << controller->stats_to_string();
+    } else {
+        for (size_t i = 0; i < controllers.size(); ++i)
+        {
+            out << "Configuration " << i << ": " << cache_config_name(cache_configs[i]) << std::endl
+                << cache_config_string(cache_configs[i]) << std::endl
+                << controllers[i]->stats_to_string();
+        }
+        out << comparison_to_string() << std::endl;
+    }
+    if (KnobFilter.Value() != "none")
+    {
+        out << filter_stats_to_string() << std::endl;
+    }
+    if (l0_enabled())
+    {
+        out << "L0 Filter Hits: " << l0_hits << " of " << (l0_hits + l0_misses)
+            << " accesses (" << (100.0 * l0_hits / (l0_hits + l0_misses)) << "%)" << std::endl << std::endl;
+    }
+    for (auto target : controllers) {
+        delete target;
+    }
+    controllers.clear();
+    controller = nullptr;
     out.close();
     PIN_ReleaseLock(&mapLock);
 }
 
 void thread_attach()
 {
-    PIN_GetLock(&mapLock, lock_id++);
+    PIN_GetLock(&mapLock, get_current_tid() + 1);
     auto temp_tid = get_current_tid();
     auto temp_pid = get_next_pid();
     std::cout << "tid " << temp_tid << " -> " << "pid " << temp_pid << std::endl;
     t_map[temp_tid] = temp_pid;
+    t_pid[temp_tid] = temp_pid;
+    if (parallel)
+    {
+        // NOTE: lanes follow the running threads, not the thread ids Pin handed out
+        uint32_t lane = std::find(lane_busy.begin(), lane_busy.end(), false) - lane_busy.begin();
+        if (lane == lane_busy.size()) {
+            lane_busy.push_back(true);
+        } else {
+            lane_busy[lane] = true;
+        }
+        t_lane[temp_tid] = lane;
+        for (auto target : controllers) {
+            target->attach_lane(lane);
+        }
+    }
+    if (recording())
+    {
+        recorder_thread_attach(temp_tid);
+    }
+    if (l0_enabled())
+    {
+        l0_filters[temp_tid] = new L0_Filter(l0_mask + 1);
+        for (ADDRINT i = 0; i <= l0_mask; ++i)
+        {
+            L0_ENTRY &entry = l0_filters[temp_tid]->entries[i];
+            l0_clear(entry, temp_tid);
+            entry.load_hits = 0;
+            entry.store_hits = 0;
+            entry.applied = 0;
+            entry.stat_addr = L0_EMPTY;
+        }
+    }
+    if (tsc_order)
+    {
+        watermark[temp_tid] = 0;
+    }
     PIN_ReleaseLock(&mapLock);
 }
 
 void thread_detach()
 {
-    PIN_GetLock(&mapLock, lock_id++);
+    PIN_GetLock(&mapLock, get_current_tid() + 1);
     uint32_t tid = get_current_tid();
     assert(t_map.find(tid) != t_map.end());
-    t_map.erase(t_map.find(tid));
+    if (recording())
+    {
+        recorder_thread_detach(tid);
+    }
+    l0_detach(tid);
+    if (parallel)
+    {
+        lane_busy[t_lane[tid]] = false;
+    }
+    if (buffered())
+    {
+        // NOTE: keep the mapping and the watermark, Pin drains the last buffer after this
+        //       callback, see drain_buffer()
+        exited.insert(tid);
+    }
+    else
+    {
+        t_map.erase(t_map.find(tid));
+    }
     PIN_ReleaseLock(&mapLock);
 }
@@ -1,256 +1,416 @@
 #include "coherence.H"
 #include "cache.H"
 
-// on a processor read with SHARED/MODIFIED
-uint64_t DIR_MSI::fetch(uint32_t      pid,
-                        uint32_t      home,
-                        uint64_t      addr,
-                        uint64_t      &hops,
-                        ACCESS_TYPE   &response)
+// the owner of a MODIFIED or OWNED line writes it back and keeps a shared copy, pid joins the sharers
+uint64_t DIR_MSI::downgrade_owner(uint32_t        pid,
+                                  uint32_t        home,
+                                  uint64_t        addr,
+                                  uint64_t        &hops,
+                                  Directory_Line  &dir,
+                                  uint32_t        lane)
 {
-    uint64_t cost = get_directory_cost(pid, home, hops);
-    Directory_Line &dir = get_directory_line(addr);
-    assert(dir.state != CACHE_STATE::INVALID);
-
-    // fetch up-to-date data
-    if (dir.is_set(pid))
-    { // requesting node is sharer/owner, no state change
-        response = ACCESS_TYPE::CACHE_HIT;
-        cost += LOCAL_CACHE_ACCESS;
+    uint32_t owner = (dir.state == CACHE_STATE::OWNED) ? dirty_owner(dir) : dir.owner(_num_processors);
+    uint64_t cost = data_write_back(owner, home, addr, hops, lane);
+    notify_downgrade(owner, addr);
+    dir.set_sharer(pid);
+    return cost;
+}
+
+// the dirty owner supplies the data to pid cache-to-cache and keeps it, pid joins the sharers
+uint64_t DIR_MSI::forward(uint32_t        pid,
+                          uint32_t        home,
+                          uint64_t        addr,
+                          uint64_t        &hops,
+                          Directory_Line  &dir,
+                          uint32_t        lane)
+{
+    uint32_t owner = dirty_owner(dir);
+    uint64_t cost = get_directory_cost(owner, home, hops);
+    // NOTE: a MODIFIED line would have been written back by a downgrade
+    profiles->profile_forward(pid, dir.state == CACHE_STATE::MODIFIED, lane);
+    dir.last_writer = owner;
+    dir.set_sharer(pid);
+    return cost;
+}
+
+// pid becomes the only sharer
+void DIR_MSI::invalidate_others(uint32_t        pid,
+                                uint32_t        home,
+                                uint64_t        addr,
+                                uint64_t        &hops,
+                                Directory_Line  &dir)
+{
+    Sharers others = dir.sharer_vector;
+    others.reset(pid);
+    others.for_each([&](uint32_t i) {
+        get_directory_cost(i, home, hops);  // NOTE: update hops
+        notify_invalidate(i, addr);
+    });
+    dir.sharer_vector = Sharers::single(pid);
+}
+
+// pid's store sends the written word to every other sharer, their copies stay valid
+uint64_t DIR_MSI::update_others(uint32_t        pid,
+                                uint32_t        home,
+                                uint64_t        addr,
+                                uint64_t        &hops,
+                                Directory_Line  &dir,
+                                uint32_t        lane)
+{
+    uint64_t messages = 0;
+    Sharers others = dir.sharer_vector;
+    others.reset(pid);
+    others.for_each([&](uint32_t i) {
+        get_directory_cost(home, i, hops);  // NOTE: update hops
+        notify_update(i, addr);
+        ++messages;
+    });
+    profiles->profile_update(pid, messages, messages * UPDATE_WORD_BYTES, lane);
+    return messages * WORD_UPDATE;
+}
+
+// the last writer speculatively pushes its data to qualified readers, invalidates the other sharers
+uint64_t DIR_MSI::push(uint32_t        pid,
+                       uint32_t        home,
+                       uint64_t        addr,
+                       uint64_t        &hops,
+                       Directory_Line  &dir,
+                       Controller      *controller,
+                       uint32_t        lane,
+                       uint64_t        pc)
+{
+    // NOTE: each core's update touches its own cache only, pushes may go first
+    uint64_t cost = 0;
+    Sharers readers = (_predictor != nullptr) ? _predictor->readers(_predictor->key(addr, pc))
+                                              : dir.qualified_readers();
+    readers.reset(pid);
+    if (_hierarchy != nullptr && _hierarchy->push_target() != PUSH_TARGET::L1) {
+        return push_below(pid, home, addr, hops, dir, readers, lane);
     }
-    else
-    { // requesting node is not sharer/owner
-        response = ACCESS_TYPE::CACHE_MISS;
-        cost += MEMORY_ACCESS;
-        if (dir.state == CACHE_STATE::MODIFIED)
+    Sharers stale = dir.sharer_vector & ~readers;
+    stale.reset(pid);
+
+    readers.for_each([&](uint32_t i) {
+        controller->fetch_cache_line(i, addr, false, lane);
+        notify_update(i, addr);
+        cost += CACHE_TO_CACHE;
+        if (!dir.is_set(i))
         {
-            uint32_t owner = dir.owner(_num_processors);
-            cost += data_write_back(owner, home, hops);
+            dir.set_sharer(i);
+            // NOTE: update hops
+            get_directory_cost(i, home, hops);
         }
-        dir.set_sharer(pid);
-        dir.state = CACHE_STATE::SHARED;
-    }
-
+    });
+    stale.for_each([&](uint32_t i) {
+        dir.clear_sharer(i);
+        notify_invalidate(i, addr);
+    });
     return cost;
 }
 
-// on cache eviction, invalidate directory line
-void DIR_MSI::invalidate(uint32_t pid, uint64_t addr)
+// the last writer pushes its data into the readers' L2s or the LLC bank at home, every other
+// sharer is invalidated and misses on the pushed data below its L1
+uint64_t DIR_MSI::push_below(uint32_t        pid,
+                             uint32_t        home,
+                             uint64_t        addr,
+                             uint64_t        &hops,
+                             Directory_Line  &dir,
+                             const Sharers   &readers,
+                             uint32_t        lane)
 {
-    Directory_Line &dir = get_directory_line(addr);
-    bool claimed = dir.is_owner(pid);
-    bool ownership = detector ? (dir.is_last_writer(pid) && claimed) : claimed;
-
-    if (ownership)
+    uint64_t cost = 0;
+    uint64_t line = addr >> _line_shift;
+    if (_hierarchy->push_target() == PUSH_TARGET::L2)
     {
-        // dirty cache line issues write back on eviction
-        uint64_t hops = 0;
-        uint32_t home = get_home_node(addr);
-        uint64_t cost = data_write_back(pid, home, hops);
-        profiles->profile_cache_evict(pid, addr, cost, hops);
-        dir.state = detector ? CACHE_STATE::SHARED :  CACHE_STATE::INVALID;
+        readers.for_each([&](uint32_t i) {
+            get_directory_cost(pid, i, hops);  // NOTE: update hops
+            cost += CACHE_TO_CACHE + _hierarchy->push_to_l2(pid, i, line, profiles, lane);
+        });
     }
-
-    dir.clear_sharer(pid);
-    if (dir.sharer_vector == 0) // no sharers
+    else if (!readers.none())
     {
-       dir.state = CACHE_STATE::INVALID;
+        cost += _hierarchy->push_to_llc(pid, line, profiles, lane);
     }
+    invalidate_others(pid, home, addr, hops, dir);
+    return cost;
 }
 
-// on a processor write with SHARED/MODIFIED (without detector)
-uint64_t DIR_MSI::fetch_and_invalidate(uint32_t     pid,
-                                       uint32_t     home,
-                                       uint64_t     addr,
-                                       uint64_t     &hops,
-                                       ACCESS_TYPE  &response)
+// apply the action of transition t to the line of a request of pid, return its cycles
+// beyond the request to home and the data
+uint64_t DIR_MSI::apply(const TRANSITION  &t,
+                        uint32_t          pid,
+                        uint32_t          home,
+                        uint64_t          addr,
+                        uint64_t          &hops,
+                        Directory_Line    &dir,
+                        Controller        *controller,
+                        uint32_t          lane,
+                        uint64_t          pc)
 {
-    uint64_t cost = fetch(pid, home, addr, hops, response);
-    Directory_Line &dir = get_directory_line(addr);
-    assert(dir.state != CACHE_STATE::INVALID);
-
-    // invalidate other sharers and claim ownership
-    for (uint32_t i = 0; i < _num_processors; ++i)
+    uint64_t cost = 0;
+    switch (t.action)
     {
-        if (dir.is_set(i) && i != pid)
-        {
-            get_directory_cost(i, home, hops);  // NOTE: update hops
-        }
-    }
+        case COHERENCE_ACTION::HIT:
+            break;
 
-    // get_directory_cost(pid, home, hops);
-    dir.sharer_vector = 0;
-    dir.set_sharer(pid);
-    dir.state = CACHE_STATE::MODIFIED;
+        case COHERENCE_ACTION::SHARE:
+            dir.set_sharer(pid);
+            break;
+
+        case COHERENCE_ACTION::DOWNGRADE:
+            cost = downgrade_owner(pid, home, addr, hops, dir, lane);
+            break;
+
+        case COHERENCE_ACTION::DEMOTE:
+            notify_downgrade(dir.owner(_num_processors), addr);
+            dir.set_sharer(pid);
+            break;
+
+        case COHERENCE_ACTION::FORWARD:
+            notify_downgrade(dirty_owner(dir), addr);
+            cost = forward(pid, home, addr, hops, dir, lane);
+            break;
+
+        case COHERENCE_ACTION::UPGRADE:
+            dir.update_last_writer(pid);
+            profiles->profile_silent_upgrade(pid, lane);
+            break;
+
+        case COHERENCE_ACTION::WRITE_MISS:
+            dir.update_last_writer(pid);
+            break;
+
+        case COHERENCE_ACTION::INVALIDATE:
+            invalidate_others(pid, home, addr, hops, dir);
+            break;
+
+        case COHERENCE_ACTION::STEAL:
+            cost = downgrade_owner(pid, home, addr, hops, dir, lane);
+            invalidate_others(pid, home, addr, hops, dir);
+            break;
+
+        case COHERENCE_ACTION::UPDATE:
+            dir.update_last_writer(pid);
+            cost = update_others(pid, home, addr, hops, dir, lane);
+            break;
+
+        case COHERENCE_ACTION::SUPPLY_UPDATE:
+            notify_downgrade(dirty_owner(dir), addr);
+            cost = forward(pid, home, addr, hops, dir, lane);
+            dir.update_last_writer(pid);
+            cost += update_others(pid, home, addr, hops, dir, lane);
+            break;
+
+        case COHERENCE_ACTION::CLAIM:
+            // NOTE: the claim is a second request to home, only its hops are charged
+            get_directory_cost(pid, home, hops);
+            dir.update_last_writer(pid);
+            invalidate_others(pid, home, addr, hops, dir);
+            break;
+
+        case COHERENCE_ACTION::FILL_AND_PUSH:
+            // NOTE: last writer is evicted
+            controller->fetch_cache_line(pid, addr, true, lane);
+            dir.set_sharer(pid);
+            cost = push(pid, home, addr, hops, dir, controller, lane, pc);
+            break;
+
+        case COHERENCE_ACTION::PUSH:
+            cost = push(pid, home, addr, hops, dir, controller, lane, pc);
+            break;
+
+        case COHERENCE_ACTION::WRITE_BACK:
+            // dirty cache line issues write back on eviction
+            cost = data_write_back(pid, home, addr, hops, lane);
+            profiles->profile_cache_evict(pid, addr, cost, hops, lane);
+            dir.clear_sharer(pid);
+            break;
+
+        case COHERENCE_ACTION::DROP:
+            dir.clear_sharer(pid);
+            break;
+    }
 
+    dir.state = dir.sharer_vector.none() ? CACHE_STATE::INVALID : t.next;
     return cost;
 }
 
-// on a processor write with SHARED/MODIFIED (with detector), speculatively push data to qualified readers
-uint64_t DIR_MSI::push_and_invalidate(uint32_t     pid,
-                                      uint32_t     home,
-                                      uint64_t     addr,
-                                      uint64_t     &hops,
-                                      ACCESS_TYPE  &response,
-                                      Controller   *controller)
+// on cache eviction, invalidate directory line
+uint64_t DIR_MSI::invalidate(uint32_t pid, uint64_t addr, uint32_t lane)
 {
-    uint64_t cost = get_directory_cost(pid, home, hops);
-    Directory_Line &dir = get_directory_line(addr);
-    assert(dir.state != CACHE_STATE::INVALID);
+    Spin_Guard guard(shard_lock(addr));
+    Directory_Line *found = find_directory_line(addr);
+    if (found == nullptr)
+    { // NOTE: untracked, e.g. a thread-private line or one a directory eviction took away
+        notify_evict(pid, addr);
+        return 0;
+    }
 
-    // requesting node is the last writer
-    if (dir.is_last_writer(pid))
-    {
-        if (!dir.is_set(pid)) //NOTE: last writer is evicted
-        {
-            cost += MEMORY_ACCESS;
-            controller->fetch_cache_line(pid, addr, true);
-            dir.set_sharer(pid);
-            response = ACCESS_TYPE::CACHE_MISS;
-        }
-        else
-        {
-            cost += LOCAL_CACHE_ACCESS;
-            response = ACCESS_TYPE::CACHE_HIT;
-        }
+    uint64_t hops = 0;
+    const TRANSITION &t = transition(pid, *found, EVICT_REQUEST);
+    uint64_t cost = apply(t, pid, get_home_node(addr), addr, hops, *found, nullptr, lane);
+    notify_evict(pid, addr);
+    return cost;
+}
 
-        for (uint32_t i = 0; i < _num_processors; ++i)
-        {
-            if (i != pid) {
-                if (dir.qualified_reader(i))
-                {
-                    controller->fetch_cache_line(i, addr, false);
-                    cost += CACHE_TO_CACHE;
-                    if (!dir.is_set(i))
-                    {
-                        dir.set_sharer(i);
-                        // NOTE: update hops
-                        get_directory_cost(i, home, hops);
-                    }
-                }
-                else if(dir.is_set(i))
-                {
-                    dir.clear_sharer(i);
-                }
-            }
-        }
-        // response = ACCESS_TYPE::CACHE_HIT;
-        dir.state = CACHE_STATE::MODIFIED;
-    }
-    else
+// on a sparse directory eviction, back-invalidate every sharer of the entry
+uint64_t DIR_MSI::recall(uint32_t        pid,
+                         uint64_t        line,
+                         Directory_Line  &dir,
+                         uint32_t        lane)
+{
+    uint64_t addr = line << _line_shift;
+    uint32_t home = get_home_node(addr);
+    uint64_t hops = 0;
+    uint64_t cost = 0;
+    uint64_t sharers = 0;
+
+    // dirty data goes back to memory before the entry is reused
+    if (dir.state == CACHE_STATE::MODIFIED || dir.state == CACHE_STATE::OWNED)
     {
-        for (uint32_t i = 0; i < _num_processors; ++i)
-        {
-            if (i != pid && dir.qualified_reader(i))
-            {
-                dir.decrease_read_count(i);
-            }
-        }
-        dir.update_last_writer(pid);
-        cost = fetch_and_invalidate(pid, home, addr, hops, response);
+        // NOTE: an entry in the LLC tags leaves with the LLC copy, the data goes past it
+        cost += _sparse.empty() ? get_directory_cost(dirty_owner(dir), home, hops) + MEMORY_ACCESS
+                                : data_write_back(dirty_owner(dir), home, addr, hops, lane);
     }
 
+    // NOTE: invalidations are sent in parallel, the slowest acknowledgement is charged
+    uint64_t latency = 0;
+    dir.sharer_vector.for_each([&](uint32_t i) {
+        latency = std::max<uint64_t>(latency, get_directory_cost(home, i, hops));
+        ++sharers;
+        notify_invalidate(i, addr);
+        notify_recall(i, addr);
+    });
+    cost += latency;
+
+    profiles->profile_directory_evict(pid, sharers, cost, hops, lane);
     return cost;
 }
 
-// on a processor read with INVALID
-uint64_t DIR_MSI::read_miss(uint32_t   pid,
-                            uint32_t   home,
-                            uint64_t   addr,
-                            uint64_t   &hops)
+// on an LLC eviction, recall the entry and write the LLC's dirty data to memory unless
+// an L1 held newer data
+uint64_t DIR_MSI::recall(uint32_t pid, LLC_VICTIM &victim, uint32_t lane)
 {
-    uint64_t cost = get_directory_cost(pid, home, hops) + MEMORY_ACCESS;
-    Directory_Line &dir = get_directory_line(addr);
-    assert(dir.state == CACHE_STATE::INVALID);
-    dir.state = CACHE_STATE::SHARED;
-    dir.set_sharer(pid);
-    return cost;
+    bool l1_dirty = victim.dir.state == CACHE_STATE::MODIFIED || victim.dir.state == CACHE_STATE::OWNED;
+    uint64_t cost = recall(pid, victim.line, victim.dir, lane);
+    return cost + ((victim.dirty && !l1_dirty) ? MEMORY_ACCESS : 0);
 }
 
-// on a processor write with INVALID
-uint64_t DIR_MSI::write_miss(uint32_t  pid,
-                             uint32_t  home,
-                             uint64_t  addr,
-                             uint64_t  &hops)
+// move the L2 victims an exclusive LLC takes during the lane's access into their banks,
+// a line without a directory entry takes a way like a new entry does
+uint64_t DIR_MSI::move_l2_victims(uint32_t lane)
 {
-    uint64_t cost = get_directory_cost(pid, home, hops) + MEMORY_ACCESS;
-    Directory_Line &dir = get_directory_line(addr);
-    assert(dir.state == CACHE_STATE::INVALID);
-    dir.state = CACHE_STATE::MODIFIED;
-    dir.set_sharer(pid);
-    return cost;
+    if (_hierarchy == nullptr) {
+        return 0;
+    }
+    uint64_t total = 0;
+    std::vector<LLC_MOVE> &moves = _hierarchy->moves(lane);
+    for (size_t m = 0; m < moves.size(); ++m)
+    {
+        uint64_t line = moves[m].line;
+        Spin_Guard guard(shard_lock(line << _line_shift));
+        if (_hierarchy->find_directory(line) == nullptr)
+        {
+            LLC_VICTIM victim;
+            _hierarchy->allocate_directory(moves[m].pid, line, victim, profiles, lane);
+            if (victim.line != Tag_Array::EMPTY) {
+                total += recall(moves[m].pid, victim, lane);
+            }
+        }
+        _hierarchy->insert_llc(line, moves[m].dirty);
+    }
+    moves.clear();
+    return total;
 }
 
 // processor read handler
-void DIR_MSI::process_read(uint32_t pid, uint64_t addr)
+uint64_t DIR_MSI::process_read(uint32_t pid, uint64_t addr, uint32_t lane, bool recalled)
 {
+    Spin_Guard guard(shard_lock(addr));
     uint64_t hops = 0;
-    uint64_t cost = 0;
-    ACCESS_TYPE response = ACCESS_TYPE::CACHE_MISS;
+    uint64_t recall_cost = 0;
 
     uint32_t home = get_home_node(addr);
-    auto &dir_line = get_directory_line(addr);
-    CACHE_STATE state = dir_line.state;
-
-    switch (state)
-    {
-        case CACHE_STATE::MODIFIED:
-        case CACHE_STATE::SHARED:
-            cost = fetch(pid, home, addr, hops, response);
-            break;
-
-        case CACHE_STATE::INVALID:
-            cost = read_miss(pid, home, addr, hops);
-            break;
-
-        default:
-            break;
+    auto &dir_line = allocate_directory_line(pid, addr, false, lane, recall_cost);
+    const TRANSITION &t = transition(pid, dir_line, LOAD_REQUEST);
+    uint64_t cost = request_cost(t, pid, home, hops);
+    cost += apply(t, pid, home, addr, hops, dir_line, nullptr, lane);
+    // NOTE: after apply, a downgraded owner's data is written back before it is fetched
+    cost += data_cost(t, pid, addr, lane);
+    if (_hierarchy != nullptr && dir_line.state == CACHE_STATE::EXCLUSIVE && !t.local)
+    { // pid may upgrade silently, copies left in the other L2s would go stale
+        _hierarchy->invalidate_copies(addr >> _line_shift, pid);
     }
 
+    ACCESS_TYPE response = t.response;
     if (response == ACCESS_TYPE::CACHE_MISS)
     {
         dir_line.increase_read_count(pid);
+        if (recalled) {
+            profiles->profile_directory_miss(pid, lane);
+        }
     }
 
-    profiles->profile_cache_load(response, pid, addr, cost, hops);
-};
+    profiles->profile_cache_load(response, pid, addr, cost, hops, lane);
+    return cost + recall_cost;
+}
 
 // processor write handler
-void DIR_MSI::process_write(uint32_t   pid,
+uint64_t DIR_MSI::process_write(uint32_t   pid,
                             uint64_t   addr,
-                            Controller *controller)
+                            Controller *controller,
+                            uint32_t   lane,
+                            bool       recalled,
+                            uint64_t   pc)
 {
+    Spin_Guard guard(shard_lock(addr));
     uint64_t hops = 0;
-    uint64_t cost = 0;
-    ACCESS_TYPE response = ACCESS_TYPE::CACHE_MISS;
+    uint64_t recall_cost = 0;
 
     uint32_t home = get_home_node(addr);
-    auto &dir_line = get_directory_line(addr);
-    CACHE_STATE state = dir_line.state;
+    auto &dir_line = allocate_directory_line(pid, addr, true, lane, recall_cost);
+    const TRANSITION &t = transition(pid, dir_line, STORE_REQUEST);
+    if (_predictor != nullptr && !served_locally(t, pid, dir_line))
+    { // the cores holding the line when the store reaches home read the previous value
+        _predictor->train(_predictor->key(addr, pc), dir_line.sharer_vector, pid);
+    }
+    if (_hierarchy != nullptr && !served_locally(t, pid, dir_line)) {
+        _hierarchy->invalidate_copies(addr >> _line_shift);
+    }
+    uint64_t cost = request_cost(t, pid, home, hops);
+    cost += apply(t, pid, home, addr, hops, dir_line, controller, lane, pc);
+    cost += data_cost(t, pid, addr, lane);
 
-    switch (state)
-    {
-        case CACHE_STATE::MODIFIED:
-        case CACHE_STATE::SHARED:
-            response = ACCESS_TYPE::CACHE_HIT;
-            if (detector)
-            {
-                cost = push_and_invalidate(pid, home,  addr, hops, response, controller);
-            }
-            else
-            {
-                cost = fetch_and_invalidate(pid, home, addr, hops, response);
-            }
-            break;
+    ACCESS_TYPE response = t.response;
+    if (response == ACCESS_TYPE::CACHE_MISS && recalled) {
+        profiles->profile_directory_miss(pid, lane);
+    }
 
-        case CACHE_STATE::INVALID:
-            dir_line.update_last_writer(pid);
-            cost = write_miss(pid, home, addr, hops);
-            break;
+    profiles->profile_cache_store(response, pid, addr, cost, hops, lane);
+    return cost + recall_cost;
+}
 
-        default:
-            break;
+// processor read/write hit that needs no directory transaction, false if it does
+bool DIR_MSI::process_local(uint32_t   pid,
+                            uint64_t   addr,
+                            bool       is_write,
+                            uint64_t   &cost,
+                            uint32_t   lane)
+{
+    Spin_Guard guard(shard_lock(addr));
+    Directory_Line *dir = find_directory_line(addr);
+    if (dir == nullptr) {
+        return false;
+    }
+    const TRANSITION &t = transition(pid, *dir, is_write ? STORE_REQUEST : LOAD_REQUEST);
+    if (!served_locally(t, pid, *dir)) {
+        return false;
     }
 
-    profiles->profile_cache_store(response, pid, addr, cost, hops);
+    uint64_t hops = 0;
+    uint32_t home = get_home_node(addr);
+    cost = request_cost(t, pid, home, hops) + t.cost;
+    apply(t, pid, home, addr, hops, *dir, nullptr, lane);
+    profiles->profile_cache_hits(pid, addr, !is_write, is_write, cost, hops, lane);
+    return true;
 }
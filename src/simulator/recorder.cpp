@@ -0,0 +1,219 @@
+#include "callbacks.H"
+#include "trace.H"
+
+#include <deque>
+#include <algorithm>
+
+extern KNOB<string> KnobRecordFile;
+
+/* ===================================================================== */
+/*  @brief Thread Trace - the chunk a thread is currently filling        */
+/* ===================================================================== */
+typedef struct
+{
+    Chunk_Header  header;
+    uint8_t       payload[TRACE_CHUNK_BYTES];
+} TRACE_CHUNK;
+
+class Thread_Trace
+{
+public:
+    Thread_Trace(THREADID tid) : tid(tid), chunk(nullptr), cur(nullptr), mark(0), unticked(0) {}
+
+public:
+    THREADID       tid;
+    TRACE_CHUNK    *chunk;
+    uint8_t        *cur;
+    Trace_Encoder  encoder;
+    uint64_t       mark;       // last clock value written to the chunk
+    uint32_t       unticked;   // accesses since this thread advanced the clock
+};
+
+FILE * trace_file = nullptr;
+TLS_KEY trace_key;
+PIN_LOCK queueLock;                       // guards everything below
+PIN_SEMAPHORE queueReady;
+PIN_THREAD_UID writer_uid;
+
+std::deque<TRACE_CHUNK *> queue;          // completed chunks, oldest first
+std::vector<Thread_Trace *> live_traces;
+uint64_t next_seq = 0;
+uint64_t trace_clock = 0;                 // NOTE: atomic, not guarded by queueLock
+uint64_t recorded_chunks = 0;
+uint64_t recorded_accesses = 0;
+uint64_t recorded_bytes = 0;
+bool stopping = false;
+
+// NOTE: caller holds queueLock
+inline void open_chunk(Thread_Trace *trace)
+{
+    trace->chunk = new TRACE_CHUNK;
+    trace->chunk->header.seq = next_seq++;
+    trace->chunk->header.tid = trace->tid;
+    trace->chunk->header.records = 0;
+    trace->chunk->header.flags = 0;
+    trace->cur = trace->chunk->payload;
+    trace->encoder.reset();
+    trace->mark = __atomic_load_n(&trace_clock, __ATOMIC_RELAXED);
+    trace->cur = trace->encoder.mark(trace->cur, trace->mark);
+}
+
+// NOTE: caller holds queueLock
+inline void close_chunk(Thread_Trace *trace)
+{
+    trace->chunk->header.bytes = trace->cur - trace->chunk->payload;
+    recorded_accesses += trace->chunk->header.records;
+    queue.push_back(trace->chunk);  // NOTE: empty chunks still mark thread start/exit
+    trace->chunk = nullptr;
+}
+
+inline void write_chunk(TRACE_CHUNK *chunk)
+{
+    fwrite(&chunk->header, sizeof(Chunk_Header), 1, trace_file);
+    fwrite(chunk->payload, 1, chunk->header.bytes, trace_file);
+    recorded_bytes += sizeof(Chunk_Header) + chunk->header.bytes;
+    ++recorded_chunks;
+    delete chunk;
+}
+
+// background writer, keeps the application off the file system
+VOID writer_main(VOID *arg)
+{
+    std::deque<TRACE_CHUNK *> batch;
+    for (;;)
+    {
+        PIN_SemaphoreWait(&queueReady);
+
+        PIN_GetLock(&queueLock, PIN_ThreadId() + 1);
+        PIN_SemaphoreClear(&queueReady);
+        batch.swap(queue);
+        bool done = stopping;
+        PIN_ReleaseLock(&queueLock);
+
+        for (auto chunk : batch) {
+            write_chunk(chunk);
+        }
+        batch.clear();
+
+        if (done) {
+            break;
+        }
+    }
+}
+
+VOID PIN_FAST_ANALYSIS_CALL trace_access(THREADID tid,
+                                         ADDRINT  addr,
+                                         UINT32   size,
+                                         ADDRINT  pc,
+                                         UINT32   flags)
+{
+    Thread_Trace *trace = static_cast<Thread_Trace *>(PIN_GetThreadData(trace_key, tid));
+    if (trace->cur + TRACE_MAX_MARK + TRACE_MAX_RECORD > trace->chunk->payload + TRACE_CHUNK_BYTES)
+    {
+        PIN_GetLock(&queueLock, tid + 1);
+        close_chunk(trace);
+        open_chunk(trace);
+        PIN_SemaphoreSet(&queueReady);
+        PIN_ReleaseLock(&queueLock);
+    }
+
+    // NOTE: the access happens no earlier than the clock value seen here
+    uint64_t clock = __atomic_load_n(&trace_clock, __ATOMIC_RELAXED);
+    if (clock != trace->mark)
+    {
+        trace->mark = clock;
+        trace->cur = trace->encoder.mark(trace->cur, clock);
+    }
+    trace->cur = trace->encoder.encode(trace->cur, addr, pc, size, static_cast<uint8_t>(flags));
+    ++trace->chunk->header.records;
+
+    if (++trace->unticked == TRACE_MARK_RECORDS)
+    {
+        trace->unticked = 0;
+        __atomic_add_fetch(&trace_clock, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void recorder_attach()
+{
+    if ((trace_file = fopen(KnobRecordFile.Value().c_str(), "wb")) == NULL)
+    {
+        cerr << "Cannot open trace file : " << KnobRecordFile.Value() << "\n";
+        exit(-1);
+    }
+
+    Trace_Header header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.reserved = 0;
+    fwrite(&header, sizeof(header), 1, trace_file);
+
+    PIN_InitLock(&queueLock);
+    PIN_SemaphoreInit(&queueReady);
+    trace_key = PIN_CreateThreadDataKey(0);
+    if (PIN_SpawnInternalThread(writer_main, 0, 0, &writer_uid) == INVALID_THREADID)
+    {
+        cerr << "Cannot spawn trace writer thread\n";
+        exit(-1);
+    }
+}
+
+void recorder_thread_attach(THREADID tid)
+{
+    Thread_Trace *trace = new Thread_Trace(tid);
+    PIN_GetLock(&queueLock, tid + 1);
+    open_chunk(trace);
+    live_traces.push_back(trace);
+    PIN_ReleaseLock(&queueLock);
+    PIN_SetThreadData(trace_key, trace, tid);
+}
+
+void recorder_thread_detach(THREADID tid)
+{
+    Thread_Trace *trace = static_cast<Thread_Trace *>(PIN_GetThreadData(trace_key, tid));
+    PIN_GetLock(&queueLock, tid + 1);
+    auto it = std::find(live_traces.begin(), live_traces.end(), trace);
+    if (it != live_traces.end())  // NOTE: recorder_detach() already flushed it otherwise
+    {
+        trace->chunk->header.flags |= TRACE_CHUNK_LAST;
+        close_chunk(trace);
+        live_traces.erase(it);
+        PIN_SemaphoreSet(&queueReady);
+    }
+    PIN_ReleaseLock(&queueLock);
+    PIN_SetThreadData(trace_key, 0, tid);
+    delete trace;
+}
+
+// ask the writer to finish, NOTE: called before Pin waits for internal threads
+void recorder_prepare_detach()
+{
+    PIN_GetLock(&queueLock, PIN_ThreadId() + 1);
+    stopping = true;
+    PIN_SemaphoreSet(&queueReady);
+    PIN_ReleaseLock(&queueLock);
+    PIN_WaitForThreadTermination(writer_uid, PIN_INFINITE_TIMEOUT, NULL);
+}
+
+// write whatever is left after the writer exited and close the trace
+std::string recorder_detach()
+{
+    PIN_GetLock(&queueLock, PIN_ThreadId() + 1);
+    // NOTE: threads still running at exit never detach, flush their chunks
+    for (auto trace : live_traces) {
+        close_chunk(trace);
+    }
+    live_traces.clear();
+    for (auto chunk : queue) {
+        write_chunk(chunk);
+    }
+    queue.clear();
+    fclose(trace_file);
+
+    std::stringstream out;
+    out << "Recorded " << recorded_accesses << " accesses in "
+        << recorded_chunks << " chunks (" << recorded_bytes << " bytes) to "
+        << KnobRecordFile.Value() << std::endl;
+    PIN_ReleaseLock(&queueLock);
+    return out.str();
+}
@@ -3,11 +3,17 @@
 #include <sstream>
 #include <iomanip>
 #include <cstdio>
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+#include <iterator>
+#include <algorithm>
 #include <assert.h>
 
 #include "pin.H"
 #include "callbacks.H"
 #include "cache.H"
+#include "trace.H"
 
 KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE,
                             "pintool",
@@ -32,8 +38,96 @@ KNOB<UINT64> KnobInstructionCount(KNOB_MODE_WRITEONCE,
                                   "l","5000000000000",
                                   "specify the number of instructions to profile");
 
+KNOB<UINT32> KnobBufferSize(KNOB_MODE_WRITEONCE,
+                            "pintool",
+                            "buffer",
+                            "0",
+                            "buffer <n> accesses per thread and simulate them in batches (0: simulate each access)");
+
+KNOB<string> KnobDrainOrder(KNOB_MODE_WRITEONCE,
+                            "pintool",
+                            "drain",
+                            "thread",
+                            "ordering of buffered accesses: thread (program order per thread) | tsc (global timestamp order)");
+
+KNOB<string> KnobFilter(KNOB_MODE_WRITEONCE,
+                        "pintool",
+                        "filter",
+                        "none",
+                        "thread-private accesses (stack, TLS, read-only data): none | skip | private (private cache only)");
+
+KNOB<string> KnobRecordFile(KNOB_MODE_WRITEONCE,
+                            "pintool",
+                            "record",
+                            "",
+                            "record a binary access trace to <file> instead of simulating");
+
+KNOB<UINT32> KnobL0Entries(KNOB_MODE_WRITEONCE,
+                           "pintool",
+                           "l0",
+                           "0",
+                           "per-thread filter of <n> recently hit addresses checked inline (power of 2, 0: disabled)");
+
+KNOB<BOOL> KnobParallel(KNOB_MODE_WRITEONCE,
+                        "pintool",
+                        "parallel",
+                        "0",
+                        "simulate on the application threads without a global lock, the result depends on host scheduling (no -buffer, -record or -l0)");
+
+KNOB<UINT32> KnobShards(KNOB_MODE_WRITEONCE,
+                        "pintool",
+                        "shards",
+                        "64",
+                        "number of directory shards with -parallel (power of 2)");
+
+KNOB<UINT32> KnobWorkers(KNOB_MODE_WRITEONCE,
+                         "pintool",
+                         "workers",
+                         "0",
+                         "simulate the configurations of a multi-config file on <n> threads fed from an access ring (0: application threads)");
+
+KNOB<UINT32> KnobMissRatioSets(KNOB_MODE_WRITEONCE,
+                               "pintool",
+                               "mrc",
+                               "0",
+                               "report LRU miss-ratio curves of the first configuration for 1..<n> sets (power of 2, 0: disabled, not with -parallel)");
+
+KNOB<UINT32> KnobTopLines(KNOB_MODE_WRITEONCE,
+                          "pintool",
+                          "top_lines",
+                          "32",
+                          "list the <n> lines with the most accesses in the report");
+
+KNOB<UINT32> KnobLineCounters(KNOB_MODE_WRITEONCE,
+                              "pintool",
+                              "line_counters",
+                              "8192",
+                              "heavy-hitter counters tracking the hottest lines, their counts are over by at most accesses/<n>");
+
+KNOB<UINT32> KnobSpin(KNOB_MODE_WRITEONCE,
+                      "pintool",
+                      "spin",
+                      "0",
+                      "collapse spin loops after <n> identical load hits and report them apart (0: disabled, turns off -l0, not with -parallel)");
+
+const UINT32 BUFFER_PAGE = 4096;
+
+extern UINT64 filtered_operands[FILTER_CLASSES];
+
 FILE *config;
-CACHE_CONFIG l1_config;
+CACHE_CONFIG l1_config;                  // first configuration
+std::vector<CACHE_CONFIG> cache_configs;  // NOTE: all share l1_config.total_processors
+BUFFER_ID access_buffer = BUFFER_ID_INVALID;
+
+typedef struct
+{
+    UINT32  img;
+    ADDRINT low;
+    ADDRINT high;
+} RO_RANGE;
+
+std::vector<RO_RANGE> ro_ranges;  // read-only sections of loaded images
+std::unordered_map<ADDRINT, UINT32> frame_rtns;  // routine address -> image id, routines that keep rbp as frame pointer
 
 INT32 usage()
 {
@@ -43,30 +137,20 @@ INT32 usage()
     return -1;
 }
 
-std::string cache_config_string(CACHE_CONFIG cache)
-{
-    std::stringstream out;
-    out << std::setw(20) << "number of set: "   << cache.num_sets         << "\n"
-        << std::setw(20) << "associativity: "   << cache.set_size         << "\n"
-        << std::setw(20) << "line size: "       << cache.line_size        << "\n"
-        << std::setw(20) << "write_strategy: "  << "WRITE_BACK_ALLOCATE"  << "\n"
-        << std::setw(20) << "coherence: "       << "MSI"                  << "\n"
-        << std::setw(20) << "interconnect: "    << "Directory"            << "\n"
-        << std::setw(20) << "Total Processors: "<< cache.total_processors << "\n";
-    return out.str();
-}
-
 LOCALFUN void init_configuration()
 {
-    /* L1 cache config */
-    if (fscanf(config, "L1 Data Cache: #Processors=%i #Sets=%i Associativity=%i LineSize=%i\n",
-               &l1_config.total_processors, &l1_config.num_sets, &l1_config.set_size, &l1_config.line_size) != 4)
+    std::string error;
+    if (!read_cache_configs(config, cache_configs, error))
     {
-        perror("fscanf: cannot access config param for L1 cache");
+        cerr << "Cannot read configuration file : " << KnobConfigFile.Value() << " (" << error << ")\n";
         exit(-1);
     }
+    l1_config = cache_configs[0];
 
-    cerr << cache_config_string(l1_config) << endl;
+    for (const auto &cache : cache_configs)
+    {
+        cerr << cache_config_string(cache) << endl;
+    }
 }
 
 LOCALFUN void initialization()
@@ -78,6 +162,259 @@ LOCALFUN void initialization()
         exit(-1);
     }
     init_configuration();
+
+    if (KnobDrainOrder.Value() != "thread" && KnobDrainOrder.Value() != "tsc")
+    {
+        cerr << "Unknown drain order : " << KnobDrainOrder.Value() << "\n";
+        usage();
+        exit(-1);
+    }
+
+    UINT32 l0 = KnobL0Entries.Value();
+    if ((l0 & (l0 - 1)) != 0)
+    {
+        cerr << "L0 filter entries must be a power of 2 : " << l0 << "\n";
+        usage();
+        exit(-1);
+    }
+
+    UINT32 mrc = KnobMissRatioSets.Value();
+    if ((mrc & (mrc - 1)) != 0)
+    {
+        cerr << "Miss-ratio curve set count must be a power of 2 : " << mrc << "\n";
+        usage();
+        exit(-1);
+    }
+
+    UINT32 shards = KnobShards.Value();
+    if (shards == 0 || (shards & (shards - 1)) != 0)
+    {
+        cerr << "Directory shards must be a power of 2 : " << shards << "\n";
+        usage();
+        exit(-1);
+    }
+
+    if (KnobFilter.Value() != "none" && KnobFilter.Value() != "skip" && KnobFilter.Value() != "private")
+    {
+        cerr << "Unknown filter mode : " << KnobFilter.Value() << "\n";
+        usage();
+        exit(-1);
+    }
+}
+
+// the routine's prologue sets up rbp as frame pointer: push rbp; mov rbp, rsp,
+// possibly after an endbr64
+LOCALFUN bool sets_frame_pointer(RTN rtn)
+{
+    INS ins = RTN_InsHead(rtn);
+    for (UINT32 i = 0; i < 2 && INS_Valid(ins); ++i, ins = INS_Next(ins))
+    {
+        if (INS_Opcode(ins) == XED_ICLASS_PUSH && INS_OperandIsReg(ins, 0) && INS_OperandReg(ins, 0) == REG_GBP)
+        {
+            INS next = INS_Next(ins);
+            return INS_Valid(next) && INS_IsMov(next)
+                && INS_OperandIsReg(next, 0) && INS_OperandReg(next, 0) == REG_GBP
+                && INS_OperandIsReg(next, 1) && INS_OperandReg(next, 1) == REG_STACK_PTR;
+        }
+    }
+    return false;
+}
+
+void Image(IMG img, void *v)
+{
+    for (SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec))
+    {
+        if (SEC_Mapped(sec) && !SEC_IsWriteable(sec) && SEC_Size(sec) > 0)
+        {
+            RO_RANGE range = {IMG_Id(img), SEC_Address(sec), SEC_Address(sec) + SEC_Size(sec)};
+            ro_ranges.push_back(range);
+        }
+        // NOTE: only the filter classifies rbp based operands
+        for (RTN rtn = SEC_RtnHead(sec); RTN_Valid(rtn) && KnobFilter.Value() != "none"; rtn = RTN_Next(rtn))
+        {
+            RTN_Open(rtn);
+            if (sets_frame_pointer(rtn)) {
+                frame_rtns[RTN_Address(rtn)] = IMG_Id(img);
+            }
+            RTN_Close(rtn);
+        }
+    }
+}
+
+void ImageUnload(IMG img, void *v)
+{
+    UINT32 id = IMG_Id(img);
+    ro_ranges.erase(std::remove_if(ro_ranges.begin(), ro_ranges.end(),
+                                   [id](const RO_RANGE &r) { return r.img == id; }),
+                    ro_ranges.end());
+    for (auto it = frame_rtns.begin(); it != frame_rtns.end(); )
+    {
+        it = (it->second == id) ? frame_rtns.erase(it) : std::next(it);
+    }
+}
+
+// rbp addresses the stack frame of ins' routine, NOTE: false outside known routines
+LOCALFUN bool frame_based(INS ins)
+{
+    RTN rtn = INS_Rtn(ins);
+    return RTN_Valid(rtn) && frame_rtns.count(RTN_Address(rtn)) > 0;
+}
+
+// classify a memory operand that can never create coherence traffic
+LOCALFUN FILTER_CLASS classify(INS ins, UINT32 memOp, bool is_write)
+{
+    UINT32 op = INS_MemoryOperandIndexToOperandIndex(ins, memOp);
+    REG base = INS_OperandMemoryBaseReg(ins, op);
+    REG segment = INS_OperandMemorySegmentReg(ins, op);
+
+    // NOTE: per operand, INS_IsStackRead/Write flag the whole instruction and count every
+    //       rbp based operand, rbp is a general register under -fomit-frame-pointer
+    if (base == REG_STACK_PTR || (base == REG_GBP && frame_based(ins)))
+    {
+        return FILTER_STACK;
+    }
+
+    if (segment == REG_SEG_FS || segment == REG_SEG_GS)
+    {
+        return FILTER_TLS;
+    }
+
+    // NOTE: only ip-relative operands have an address known at instrumentation time
+    if (!is_write && base == REG_INST_PTR && !REG_valid(INS_OperandMemoryIndexReg(ins, op)))
+    {
+        ADDRINT ea = INS_NextAddress(ins) + INS_OperandMemoryDisplacement(ins, op);
+        for (const auto &range : ro_ranges)
+        {
+            if (ea >= range.low && ea < range.high)
+            {
+                return FILTER_RODATA;
+            }
+        }
+    }
+
+    return FILTER_NONE;
+}
+
+// append one access to the thread's buffer, drained by drain_buffer()
+LOCALFUN void insert_fill_buffer(INS ins, IARG_TYPE ea, bool is_write, FILTER_CLASS filter)
+{
+    if (KnobDrainOrder.Value() == "tsc")
+    {
+        INS_InsertFillBufferPredicated(
+            ins, IPOINT_BEFORE, access_buffer,
+            ea,         offsetof(ACCESS_RECORD, addr),
+            IARG_INST_PTR, offsetof(ACCESS_RECORD, pc),
+            IARG_UINT32, is_write, offsetof(ACCESS_RECORD, is_write),
+            IARG_UINT32, filter, offsetof(ACCESS_RECORD, filter),
+            IARG_TSC,   offsetof(ACCESS_RECORD, tsc),
+            IARG_END);
+    }
+    else
+    {
+        INS_InsertFillBufferPredicated(
+            ins, IPOINT_BEFORE, access_buffer,
+            ea,         offsetof(ACCESS_RECORD, addr),
+            IARG_INST_PTR, offsetof(ACCESS_RECORD, pc),
+            IARG_UINT32, is_write, offsetof(ACCESS_RECORD, is_write),
+            IARG_UINT32, filter, offsetof(ACCESS_RECORD, filter),
+            IARG_END);
+    }
+}
+
+// instrument a single memory operand according to '-buffer' and '-filter'
+LOCALFUN void insert_access(INS ins, UINT32 memOp, bool is_write)
+{
+    IARG_TYPE ea = is_write ? IARG_MEMORYWRITE_EA : IARG_MEMORYREAD_EA;
+    FILTER_CLASS filter = FILTER_NONE;
+
+    if (KnobFilter.Value() != "none")
+    {
+        filter = classify(ins, memOp, is_write);
+        ++filtered_operands[filter];
+    }
+
+    if (filter != FILTER_NONE && KnobFilter.Value() == "skip")
+    {
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR) count_filtered,
+            IARG_FAST_ANALYSIS_CALL,
+            IARG_THREAD_ID,
+            IARG_UINT32, filter,
+            IARG_END);
+    }
+    else if (!KnobRecordFile.Value().empty())
+    {
+        UINT32 flags = (is_write ? TRACE_WRITE : 0) | (filter != FILTER_NONE ? TRACE_PRIVATE : 0);
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR) trace_access,
+            IARG_FAST_ANALYSIS_CALL,
+            IARG_THREAD_ID,
+            ea,
+            is_write ? IARG_MEMORYWRITE_SIZE : IARG_MEMORYREAD_SIZE,
+            IARG_INST_PTR,
+            IARG_UINT32, flags,
+            IARG_END);
+    }
+    else if (access_buffer != BUFFER_ID_INVALID)
+    {
+        insert_fill_buffer(ins, ea, is_write, filter);
+    }
+    else if (filter != FILTER_NONE)
+    {
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR) cache_private_access,
+            IARG_THREAD_ID,
+            ea,
+            IARG_UINT32, filter,
+            IARG_END);
+    }
+    else if (l0_enabled())
+    {
+        // only filter misses and upgrades reach the simulator
+        AFUNPTR check = l0_packed() ? (AFUNPTR) (is_write ? l0_store_packed : l0_load_packed)
+                                    : (AFUNPTR) (is_write ? l0_store : l0_load);
+        INS_InsertIfPredicatedCall(
+            ins, IPOINT_BEFORE, check,
+            IARG_FAST_ANALYSIS_CALL,
+            IARG_THREAD_ID,
+            ea,
+            IARG_END);
+        INS_InsertThenPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR) (is_write ? l0_cache_store : l0_cache_load),
+            IARG_THREAD_ID,
+            ea,
+            IARG_INST_PTR,
+            IARG_END);
+    }
+    else if (KnobParallel.Value())
+    {
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR) (is_write ? parallel_store : parallel_load),
+            IARG_THREAD_ID,
+            ea,
+            IARG_INST_PTR,
+            IARG_END);
+    }
+    else if (is_write)
+    {
+        // NOTE: the instruction pointer indexes a predictor, see 'PredictorIndex=PC'
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR) cache_store,
+            IARG_THREAD_ID,
+            ea,
+            IARG_INST_PTR,
+            IARG_END);
+    }
+    else
+    {
+        // NOTE: the instruction pointer tells spin loops apart, see '-spin'
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR) cache_load,
+            IARG_THREAD_ID,
+            ea,
+            IARG_INST_PTR,
+            IARG_END);
+    }
 }
 
 // referreed https://software.intel.com/sites/landingpage/pintool/docs/76991/Pin/html/index.html#MAddressTrace
@@ -90,20 +427,12 @@ void Instruction(INS ins, void *v)
     {
         if (INS_MemoryOperandIsRead(ins, memOp))
         {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR) cache_load,
-                IARG_THREAD_ID,
-                IARG_MEMORYREAD_EA,
-                IARG_END);
+            insert_access(ins, memOp, false);
         }
 
         if (INS_MemoryOperandIsWritten(ins, memOp))
         {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR) cache_store,
-                IARG_THREAD_ID,
-                IARG_MEMORYWRITE_EA,
-                IARG_END);
+            insert_access(ins, memOp, true);
         }
     }
 }
@@ -118,6 +447,15 @@ void ThreadFini(THREADID threadid, const CONTEXT *ctxt, INT32 code, void *v)
     thread_detach();
 }
 
+void PrepareFini(void * v)
+{
+    if (!KnobRecordFile.Value().empty())
+    {
+        recorder_prepare_detach();
+    }
+    workers_prepare_detach();
+}
+
 void Fini(int code, void * v)
 {
     process_detach();
@@ -133,11 +471,30 @@ int main(int argc, char *argv[])
 
     initialization();
 
+    if (KnobBufferSize.Value() > 0 && KnobRecordFile.Value().empty())
+    {
+        UINT32 pages = (KnobBufferSize.Value() * sizeof(ACCESS_RECORD) + BUFFER_PAGE - 1) / BUFFER_PAGE;
+        access_buffer = PIN_DefineTraceBuffer(sizeof(ACCESS_RECORD), pages, drain_buffer, 0);
+        if (access_buffer == BUFFER_ID_INVALID)
+        {
+            cerr << "Cannot allocate access buffers of " << pages << " pages\n";
+            return -1;
+        }
+    }
+
+    // Register Image to be called to track read-only sections for '-filter'
+    IMG_AddInstrumentFunction(Image, 0);
+    IMG_AddUnloadFunction(ImageUnload, 0);
+
     // Register Trace to be called when each instruction is loaded.
     INS_AddInstrumentFunction(Instruction, 0);
 
     // Register Fini to be called when the application exits
     PIN_AddFiniFunction(Fini, 0);
+    if (!KnobRecordFile.Value().empty() || KnobWorkers.Value() > 0)
+    {
+        PIN_AddPrepareForFiniFunction(PrepareFini, 0);
+    }
 
     // Register thr_begin/thr_end to be called when a thread begins/ends
     PIN_AddThreadStartFunction(ThreadStart, (void *) 0);